@@ -17,8 +17,9 @@ COMPONENT_OBJEXCLUDE := blackmagic/src/platforms/common/cdcacm.o \
 						blackmagic/src/platforms/common/aux_serial.o \
 						blackmagic/src/platforms/common/usb.o \
 						blackmagic/src/platforms/common/usb_dfu_stub.o \
-						blackmagic/src/platforms/common/usb_serial.o
-#						blackmagic/src/platforms/common/swdptap.o \
+						blackmagic/src/platforms/common/usb_serial.o \
+						blackmagic/src/platforms/common/swdptap.o \
+						blackmagic/src/platforms/common/jtagtap.o
 
 
 $(COMPONENT_PATH)/blackmagic/src/include/version.h: 
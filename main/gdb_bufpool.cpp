@@ -0,0 +1,111 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "FreeRTOS.h"
+#include "semphr.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "nvs.h"
+#include "sdkconfig.h"
+
+#include "gdb_bufpool.hpp"
+
+extern "C" nvs_handle h_nvs_conf;
+
+static_assert(CONFIG_GDB_PACKET_SIZE <= GDB_PACKET_SIZE_MAX,
+	"CONFIG_GDB_PACKET_SIZE too large for CONFIG_GDB_PACKET_POOL_BUFFERS");
+
+/* Heap left over when growing the packet size at runtime */
+#define GDB_HEAP_RESERVE (8 * 1024)
+
+struct pool_slot {
+	char *buf;
+	size_t size;
+	bool used;
+};
+
+static pool_slot pool[CONFIG_GDB_PACKET_POOL_BUFFERS];
+static SemaphoreHandle_t pool_free;
+static SemaphoreHandle_t pool_mutex;
+static size_t packet_size = CONFIG_GDB_PACKET_SIZE;
+
+void gdb_bufpool_init()
+{
+	pool_free = xSemaphoreCreateCounting(CONFIG_GDB_PACKET_POOL_BUFFERS, CONFIG_GDB_PACKET_POOL_BUFFERS);
+	pool_mutex = xSemaphoreCreateMutex();
+
+	uint32_t size;
+	if (nvs_get_u32(h_nvs_conf, "pktsize", &size) == ESP_OK &&
+		size >= GDB_PACKET_SIZE_MIN && size <= GDB_PACKET_SIZE_MAX) {
+		packet_size = size;
+	}
+	ESP_LOGI("GDB", "packet size %u, %d shared buffers", (unsigned)packet_size, CONFIG_GDB_PACKET_POOL_BUFFERS);
+}
+
+char *gdb_bufpool_get(bool wait, size_t need, size_t *size)
+{
+	if (xSemaphoreTake(pool_free, wait ? portMAX_DELAY : 0) != pdTRUE)
+		return NULL;
+
+	xSemaphoreTake(pool_mutex, portMAX_DELAY);
+	/* Prefer a buffer that already has the size, clients that connected
+	 * before a packet size change keep asking for the old one */
+	pool_slot *slot = NULL;
+	for (pool_slot &s : pool) {
+		if (s.used)
+			continue;
+		if (!slot || s.size == need)
+			slot = &s;
+		if (s.size == need)
+			break;
+	}
+	if (slot->size != need) {
+		free(slot->buf);
+		slot->buf = (char *)malloc(need);
+		slot->size = slot->buf ? need : 0;
+	}
+	char *buf = slot->buf;
+	slot->used = buf != NULL;
+	*size = slot->size;
+	xSemaphoreGive(pool_mutex);
+
+	if (!buf) {
+		ESP_LOGE("GDB", "no memory for a %u byte packet buffer", (unsigned)need);
+		xSemaphoreGive(pool_free);
+	}
+	return buf;
+}
+
+void gdb_bufpool_put(char *buf)
+{
+	if (!buf)
+		return;
+
+	xSemaphoreTake(pool_mutex, portMAX_DELAY);
+	for (pool_slot &slot : pool) {
+		if (slot.buf == buf) {
+			slot.used = false;
+			break;
+		}
+	}
+	xSemaphoreGive(pool_mutex);
+	xSemaphoreGive(pool_free);
+}
+
+size_t gdb_packet_size()
+{
+	return packet_size;
+}
+
+bool gdb_packet_size_set(size_t size)
+{
+	if (size < GDB_PACKET_SIZE_MIN || size > GDB_PACKET_SIZE_MAX)
+		return false;
+	/* Growing needs room for the pool and a TX buffer at the new size */
+	if (size > packet_size &&
+		esp_get_free_heap_size() < (size - packet_size) * (CONFIG_GDB_PACKET_POOL_BUFFERS + 1) + GDB_HEAP_RESERVE)
+		return false;
+	packet_size = size;
+	nvs_set_u32(h_nvs_conf, "pktsize", size);
+	return true;
+}
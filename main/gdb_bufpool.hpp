@@ -0,0 +1,25 @@
+#pragma once
+#include <stddef.h>
+
+#include "sdkconfig.h"
+
+/* Packet buffers shared by all GDB clients. A client only holds one while
+ * it is receiving or handling a packet, so a couple of large buffers serve
+ * any number of connections.
+ */
+void gdb_bufpool_init();
+/* Buffer of need bytes, a free buffer of another size is reallocated */
+char *gdb_bufpool_get(bool wait, size_t need, size_t *size);
+void gdb_bufpool_put(char *buf);
+
+/* Packet size advertised in qSupported. A client keeps the size it was
+ * given, a new size only applies to clients that ask afterwards. */
+size_t gdb_packet_size();
+bool gdb_packet_size_set(size_t size);
+
+/* Heap for packet sized buffers: the pool and one client's TX buffer */
+#define GDB_PACKET_MEMORY_MAX (24 * 1024)
+#define GDB_PACKET_SIZE_MIN 512
+#define GDB_PACKET_SIZE_MAX \
+	(GDB_PACKET_MEMORY_MAX / (CONFIG_GDB_PACKET_POOL_BUFFERS + 1) < 16384 ? \
+	 GDB_PACKET_MEMORY_MAX / (CONFIG_GDB_PACKET_POOL_BUFFERS + 1) : 16384)
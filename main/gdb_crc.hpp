@@ -0,0 +1,23 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sdkconfig.h"
+
+extern "C" {
+#include "target.h"
+}
+
+/* CRC-32 as used by GDB's qCRC: polynomial 0x04C11DB7, MSB first, no
+ * final inversion. Start with 0xffffffff. Table driven, eight bytes per
+ * step. */
+uint32_t gdb_crc32(uint32_t crc, const void *buf, size_t len);
+/* Same result as generic_crc32(), reading the target in large blocks */
+bool gdb_target_crc32(target *t, uint32_t *crc, target_addr_t addr, size_t len);
+
+#ifdef CONFIG_GDB_CRC_STUB
+/* Runs the CRC on a halted Cortex-M from a stub loaded into its RAM.
+ * Registers and the borrowed RAM are restored afterwards. False when the
+ * target can't run it, the caller then falls back to reading memory. */
+bool gdb_target_crc32_stub(target *t, uint32_t *crc, target_addr_t addr, size_t len);
+#endif
@@ -0,0 +1,278 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "sdkconfig.h"
+#include "esp_log.h"
+
+extern "C" {
+#include "general.h"
+#include "gdb_packet.h"
+#include "target.h"
+#include "target/target_internal.h"
+}
+
+#include "gdb_if.hpp"
+#include "gdb_flashinc.hpp"
+#include "gdb_flashpipe.hpp"
+#include "gdb_crc.hpp"
+
+#define ERASE_RANGES	16
+/* Changed sectors are programmed in packet sized pieces */
+#define PROGRAM_CHUNK	1024
+
+struct erase_range {
+	target_addr_t start;
+	target_addr_t end;
+};
+
+static erase_range erases[ERASE_RANGES];
+static int n_erases;
+
+/* Sector being gathered, bytes GDB didn't send keep the erased value */
+static struct {
+	target *t;
+	target_addr_t addr;
+	size_t size;
+	size_t lo, hi;
+	bool valid;
+} sector;
+static uint8_t *sector_buf;
+
+#ifdef CONFIG_GDB_FLASH_INCREMENTAL
+static bool inc_enabled = true;
+#else
+static bool inc_enabled = false;
+#endif
+static uint32_t n_unchanged, n_rewritten;
+
+static uint32_t crc_fill(uint8_t value, size_t len)
+{
+	uint8_t fill[64];
+	uint32_t crc = 0xffffffff;
+	memset(fill, value, sizeof(fill));
+	while (len) {
+		size_t n = len < sizeof(fill) ? len : sizeof(fill);
+		crc = gdb_crc32(crc, fill, n);
+		len -= n;
+	}
+	return crc;
+}
+
+static struct target_flash *flash_find(target *t, target_addr_t addr)
+{
+	for (struct target_flash *f = t->flash; f; f = f->next)
+		if (addr >= f->start && addr < f->start + f->length)
+			return f;
+	return nullptr;
+}
+
+static bool flash_erase(target *t, target_addr_t addr, size_t len)
+{
+	/* Queued writes may still be headed for this flash */
+	gdb_flash_pipe_wait();
+	GDB_LOCK();
+	return target_flash_erase(t, addr, len);
+}
+
+static bool flash_program(target *t, target_addr_t dest, const uint8_t *src, size_t len)
+{
+	while (len) {
+		size_t n = len < PROGRAM_CHUNK ? len : PROGRAM_CHUNK;
+#ifdef CONFIG_GDB_FLASH_PIPELINE
+		if (!gdb_flash_pipe_write(t, dest, src, n))
+			return false;
+#else
+		GDB_LOCK();
+		if (!target_flash_write(t, dest, src, n))
+			return false;
+#endif
+		dest += n;
+		src += n;
+		len -= n;
+	}
+	return true;
+}
+
+static erase_range *erase_find(target_addr_t addr, size_t size)
+{
+	for (int i = 0; i < n_erases; i++)
+		if (addr >= erases[i].start && addr + size <= erases[i].end)
+			return &erases[i];
+	return nullptr;
+}
+
+/* Takes a sector out of the deferred erases, the caller now owns it */
+static bool erase_forget(target *t, erase_range *r, target_addr_t addr, size_t size)
+{
+	if (addr == r->start) {
+		r->start += size;
+	} else if (addr + size == r->end) {
+		r->end = addr;
+	} else if (n_erases < ERASE_RANGES) {
+		erases[n_erases++] = { (target_addr_t)(addr + size), r->end };
+		r->end = addr;
+	} else {
+		/* No room to split, erase the tail for real */
+		target_addr_t end = r->end;
+		r->end = addr;
+		if (!flash_erase(t, addr + size, end - addr - size))
+			return false;
+	}
+	if (r->start == r->end)
+		*r = erases[--n_erases];
+	return true;
+}
+
+static bool sector_commit()
+{
+	if (!sector.valid)
+		return true;
+	sector.valid = false;
+
+	uint32_t expect = gdb_crc32(0xffffffff, sector_buf, sector.size);
+	uint32_t actual;
+	bool same;
+	{
+		GDB_LOCK();
+		same = gdb_target_crc32(sector.t, &actual, sector.addr, sector.size) && actual == expect;
+	}
+	if (same) {
+		n_unchanged++;
+		return true;
+	}
+	n_rewritten++;
+	return flash_erase(sector.t, sector.addr, sector.size) &&
+	       flash_program(sector.t, sector.addr + sector.lo, sector_buf + sector.lo,
+			     sector.hi - sector.lo);
+}
+
+bool gdb_flash_inc_enabled()
+{
+	return inc_enabled;
+}
+
+void gdb_flash_inc_begin()
+{
+	n_erases = 0;
+	sector.valid = false;
+	n_unchanged = n_rewritten = 0;
+}
+
+void gdb_flash_inc_abort()
+{
+	gdb_flash_inc_begin();
+	free(sector_buf);
+	sector_buf = nullptr;
+}
+
+bool gdb_flash_inc_erase(target *t, target_addr_t addr, size_t len)
+{
+	if (n_erases && erases[n_erases - 1].end == addr) {
+		erases[n_erases - 1].end += len;
+		return true;
+	}
+	if (n_erases == ERASE_RANGES)
+		return flash_erase(t, addr, len);
+	erases[n_erases++] = { addr, (target_addr_t)(addr + len) };
+	return true;
+}
+
+bool gdb_flash_inc_write(target *t, target_addr_t addr, const void *src, size_t len)
+{
+	const uint8_t *data = (const uint8_t *)src;
+
+	while (len) {
+		struct target_flash *f = flash_find(t, addr);
+		if (!f) {
+			return sector_commit() && flash_program(t, addr, data, len);
+		}
+		size_t size = f->blocksize;
+		target_addr_t start = f->start + (addr - f->start) / size * size;
+		size_t n = start + size - addr;
+		if (n > len)
+			n = len;
+
+		if (sector.valid && sector.addr != start && !sector_commit())
+			return false;
+
+		if (!sector.valid) {
+			erase_range *r = erase_find(start, size);
+			if (!r) {
+				/* Not erased by this load, pass it through */
+				if (!flash_program(t, addr, data, n))
+					return false;
+				goto next;
+			}
+			if (!erase_forget(t, r, start, size))
+				return false;
+			if (!sector_buf && size <= CONFIG_GDB_FLASH_INCREMENTAL_SECTOR_MAX)
+				sector_buf = (uint8_t *)malloc(CONFIG_GDB_FLASH_INCREMENTAL_SECTOR_MAX);
+			if (!sector_buf || size > CONFIG_GDB_FLASH_INCREMENTAL_SECTOR_MAX) {
+				/* Too big to gather, always rewritten */
+				n_rewritten++;
+				if (!flash_erase(t, start, size) || !flash_program(t, addr, data, n))
+					return false;
+				goto next;
+			}
+			memset(sector_buf, f->erased, size);
+			sector.t = t;
+			sector.addr = start;
+			sector.size = size;
+			sector.lo = size;
+			sector.hi = 0;
+			sector.valid = true;
+		}
+		memcpy(sector_buf + (addr - start), data, n);
+		if (addr - start < sector.lo)
+			sector.lo = addr - start;
+		if (addr - start + n > sector.hi)
+			sector.hi = addr - start + n;
+next:
+		addr += n;
+		data += n;
+		len -= n;
+	}
+	return true;
+}
+
+bool gdb_flash_inc_done(target *t)
+{
+	bool ok = sector_commit();
+
+	/* Erased but never written, only erase what isn't blank already */
+	for (int i = 0; i < n_erases; i++) {
+		target_addr_t addr = erases[i].start;
+		while (addr < erases[i].end) {
+			struct target_flash *f = flash_find(t, addr);
+			if (!f)
+				break;
+			size_t size = f->blocksize;
+			uint32_t crc;
+			bool blank;
+			{
+				GDB_LOCK();
+				blank = gdb_target_crc32(t, &crc, addr, size) && crc == crc_fill(f->erased, size);
+			}
+			if (!blank && !flash_erase(t, addr, size))
+				ok = false;
+			addr += size;
+		}
+	}
+	n_erases = 0;
+	free(sector_buf);
+	sector_buf = nullptr;
+
+	ESP_LOGI("flash", "incremental load: %u sectors unchanged, %u rewritten",
+		 n_unchanged, n_rewritten);
+	return ok;
+}
+
+bool gdb_flash_inc_command(target *t, int argc, const char **argv)
+{
+	(void)t;
+	if (argc == 2)
+		inc_enabled = !strcmp(argv[1], "enable");
+	gdb_outf("Incremental flashing: %s, last load %u sectors unchanged, %u rewritten\n",
+		inc_enabled ? "enabled" : "disabled", n_unchanged, n_rewritten);
+	return true;
+}
@@ -0,0 +1,24 @@
+#pragma once
+#include <stddef.h>
+
+extern "C" {
+#include "target.h"
+}
+
+/* Incremental flashing. While enabled, vFlashErase only records the
+ * range and vFlashWrite data is gathered a sector at a time. A complete
+ * sector is compared by CRC against the target and only erased and
+ * programmed when it differs. Sectors larger than
+ * CONFIG_GDB_FLASH_INCREMENTAL_SECTOR_MAX are always rewritten.
+ */
+bool gdb_flash_inc_enabled();
+/* Drops state left over from an aborted load */
+void gdb_flash_inc_begin();
+/* Drops the load and frees the sector buffer, when its client goes away */
+void gdb_flash_inc_abort();
+bool gdb_flash_inc_erase(target *t, target_addr_t addr, size_t len);
+/* Errors in earlier sectors may be reported by a later call */
+bool gdb_flash_inc_write(target *t, target_addr_t addr, const void *src, size_t len);
+/* Finishes the last sector and any erase that received no data */
+bool gdb_flash_inc_done(target *t);
+bool gdb_flash_inc_command(target *t, int argc, const char **argv);
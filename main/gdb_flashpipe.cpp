@@ -0,0 +1,144 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "sdkconfig.h"
+
+#ifdef CONFIG_GDB_FLASH_PIPELINE
+
+#include "FreeRTOS.h"
+#include "queue.h"
+#include "semphr.h"
+#include "task.h"
+#include "esp_log.h"
+
+extern "C" {
+#include "exception.h"
+#include "target.h"
+}
+
+#include "gdb_if.hpp"
+#include "gdb_flashpipe.hpp"
+
+#define FLASH_JOBS	2
+/* target_flash_write() and the flash driver below it */
+#define FLASH_STACK	2560
+
+struct flash_job {
+	target *t;
+	target_addr_t dest;
+	size_t len;
+	uint8_t *buf;
+	size_t size;
+};
+
+static flash_job jobs[FLASH_JOBS];
+static int next_job;
+static xQueueHandle job_queue;		/* flash_job *, NULL stops the task */
+static xSemaphoreHandle free_jobs;
+/* Draining takes every free_jobs token, two tasks doing it at once could
+ * each end up holding some and wait on each other forever */
+static xSemaphoreHandle drain;
+static xSemaphoreHandle stopped;
+static bool running;
+static volatile bool failed;
+
+static void flash_task(void *arg)
+{
+	(void)arg;
+	void* tls[2] = {};
+	vTaskSetThreadLocalStoragePointer(0, 0, tls); //used for exception handling
+
+	flash_job *job;
+	while (xQueueReceive(job_queue, &job, portMAX_DELAY) == pdTRUE && job) {
+		bool ok = false;
+		{
+			GDBLock lock(GDB_LOCK_FLASH);
+			volatile struct exception e;
+			TRY_CATCH (e, EXCEPTION_ALL) {
+				ok = target_flash_write(job->t, job->dest, job->buf, job->len);
+			}
+			if (e.type)
+				ok = false;
+		}
+		if (!ok) {
+			ESP_LOGE("flash", "write %08x len %u failed", job->dest, (unsigned)job->len);
+			failed = true;
+		}
+		xSemaphoreGive(free_jobs);
+	}
+	ESP_LOGI("flash", "task exits, %u of %u stack unused",
+		 (unsigned)uxTaskGetStackHighWaterMark(NULL), FLASH_STACK);
+	xSemaphoreGive(stopped);
+	vTaskDelete(NULL);
+}
+
+bool gdb_flash_pipe_write(target *t, target_addr_t dest, const void *src, size_t len)
+{
+	if (failed) {
+		failed = false;
+		return false;
+	}
+	if (!job_queue) {
+		job_queue = xQueueCreate(FLASH_JOBS + 1, sizeof(flash_job *));
+		free_jobs = xSemaphoreCreateCounting(FLASH_JOBS, FLASH_JOBS);
+		drain = xSemaphoreCreateMutex();
+		stopped = xSemaphoreCreateBinary();
+	}
+	if (!running) {
+		if (xTaskCreate(flash_task, "flash", FLASH_STACK, NULL, 1, NULL) != pdPASS)
+			return false;
+		running = true;
+	}
+
+	xSemaphoreTake(free_jobs, portMAX_DELAY);
+	flash_job *job = &jobs[next_job];
+	if (job->size < len) {
+		free(job->buf);
+		job->buf = (uint8_t *)malloc(len);
+		job->size = job->buf ? len : 0;
+		if (!job->buf) {
+			xSemaphoreGive(free_jobs);
+			return false;
+		}
+	}
+	next_job = (next_job + 1) % FLASH_JOBS;
+	memcpy(job->buf, src, len);
+	job->t = t;
+	job->dest = dest;
+	job->len = len;
+	xQueueSend(job_queue, &job, portMAX_DELAY);
+	return true;
+}
+
+void gdb_flash_pipe_wait()
+{
+	if (!running)
+		return;
+	xSemaphoreTake(drain, portMAX_DELAY);
+	for (int i = 0; i < FLASH_JOBS; i++)
+		xSemaphoreTake(free_jobs, portMAX_DELAY);
+	for (int i = 0; i < FLASH_JOBS; i++)
+		xSemaphoreGive(free_jobs);
+	xSemaphoreGive(drain);
+}
+
+bool gdb_flash_pipe_done()
+{
+	if (running) {
+		flash_job *stop = nullptr;
+		xQueueSend(job_queue, &stop, portMAX_DELAY);
+		xSemaphoreTake(stopped, portMAX_DELAY);
+		running = false;
+		for (flash_job &job : jobs) {
+			free(job.buf);
+			job.buf = nullptr;
+			job.size = 0;
+		}
+		next_job = 0;
+	}
+	bool ok = !failed;
+	failed = false;
+	return ok;
+}
+
+#endif
@@ -0,0 +1,28 @@
+#pragma once
+#include <stddef.h>
+
+#include "sdkconfig.h"
+
+extern "C" {
+#include "target.h"
+}
+
+/* Pipelined flash programming. vFlashWrite payloads are copied into one
+ * of two staging buffers and programmed by a background task, so the
+ * next packet is received while the previous one goes out over SWD.
+ * A failed write is reported on the following vFlashWrite or on
+ * vFlashDone.
+ */
+#ifdef CONFIG_GDB_FLASH_PIPELINE
+/* Queues a write, false if it couldn't be or an earlier one failed */
+bool gdb_flash_pipe_write(target *t, target_addr_t dest, const void *src, size_t len);
+/* Waits until every queued write has been programmed */
+void gdb_flash_pipe_wait();
+/* Waits, then stops the task, frees the buffers and clears a latched
+ * failure. Also the teardown when the loading client goes away. False
+ * if any write failed since the last report */
+bool gdb_flash_pipe_done();
+#else
+static inline void gdb_flash_pipe_wait() {}
+static inline bool gdb_flash_pipe_done() { return true; }
+#endif
@@ -0,0 +1,148 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "gdb_hex.hpp"
+
+/* Two hex characters for every byte value */
+static const char hex_pairs[513] =
+	"000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f"
+	"202122232425262728292a2b2c2d2e2f303132333435363738393a3b3c3d3e3f"
+	"404142434445464748494a4b4c4d4e4f505152535455565758595a5b5c5d5e5f"
+	"606162636465666768696a6b6c6d6e6f707172737475767778797a7b7c7d7e7f"
+	"808182838485868788898a8b8c8d8e8f909192939495969798999a9b9c9d9e9f"
+	"a0a1a2a3a4a5a6a7a8a9aaabacadaeafb0b1b2b3b4b5b6b7b8b9babbbcbdbebf"
+	"c0c1c2c3c4c5c6c7c8c9cacbcccdcecfd0d1d2d3d4d5d6d7d8d9dadbdcdddedf"
+	"e0e1e2e3e4e5e6e7e8e9eaebecedeeeff0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
+
+/* Value of every character as a hex digit, -1 if it isn't one */
+static const int8_t hex_values[256] = {
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	 0,  1,  2,  3,  4,  5,  6,  7,  8,  9, -1, -1, -1, -1, -1, -1,
+	-1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+};
+
+static inline void put_pair(char *hex, uint8_t b)
+{
+	hex[0] = hex_pairs[2 * b];
+	hex[1] = hex_pairs[2 * b + 1];
+}
+
+static inline uint8_t get_pair(const char *hex)
+{
+	return ((hex_values[(uint8_t)hex[0]] & 0xf) << 4) | (hex_values[(uint8_t)hex[1]] & 0xf);
+}
+
+/* Converts a word at a time. All input bytes of a word are loaded before
+ * any output is stored, so m replies can hexify in place from the upper
+ * half of the packet buffer.
+ */
+char *gdb_hexify(char *hex, const void *buf, size_t size)
+{
+	const uint8_t *src = (const uint8_t *)buf;
+	char *dst = hex;
+
+	/* Word loads only when aligned, the lx106 faults on unaligned ones */
+	while (size && ((uintptr_t)src & 3)) {
+		put_pair(dst, *src++);
+		dst += 2;
+		size--;
+	}
+	while (size >= 4) {
+		uint32_t w;
+		memcpy(&w, src, sizeof(w));
+		put_pair(dst, w);
+		put_pair(dst + 2, w >> 8);
+		put_pair(dst + 4, w >> 16);
+		put_pair(dst + 6, w >> 24);
+		src += 4;
+		dst += 8;
+		size -= 4;
+	}
+	while (size--) {
+		put_pair(dst, *src++);
+		dst += 2;
+	}
+	*dst = 0;
+	return hex;
+}
+
+char *gdb_unhexify(void *buf, const char *hex, size_t size)
+{
+	uint8_t *dst = (uint8_t *)buf;
+
+	while (size >= 4) {
+		uint8_t b0 = get_pair(hex);
+		uint8_t b1 = get_pair(hex + 2);
+		uint8_t b2 = get_pair(hex + 4);
+		uint8_t b3 = get_pair(hex + 6);
+		dst[0] = b0;
+		dst[1] = b1;
+		dst[2] = b2;
+		dst[3] = b3;
+		hex += 8;
+		dst += 4;
+		size -= 4;
+	}
+	while (size--) {
+		*dst++ = get_pair(hex);
+		hex += 2;
+	}
+	return (char *)buf;
+}
+
+int gdb_unhex_digit(char c)
+{
+	return hex_values[(uint8_t)c];
+}
+
+uint32_t gdb_hex_parse(const char **str)
+{
+	const char *p = *str;
+	uint32_t value = 0;
+	int digit;
+
+	while ((digit = hex_values[(uint8_t)*p]) >= 0) {
+		value = (value << 4) | digit;
+		p++;
+	}
+	*str = p;
+	return value;
+}
+
+const char *gdb_hex_addr_len(const char *str, uint32_t *addr, uint32_t *len)
+{
+	const char *p = str;
+
+	*addr = gdb_hex_parse(&p);
+	if (p == str || *p++ != ',')
+		return NULL;
+	str = p;
+	*len = gdb_hex_parse(&p);
+	if (p == str)
+		return NULL;
+	return p;
+}
+
+size_t gdb_hex_u32(char *hex, uint32_t value)
+{
+	size_t len = 1;
+	while (len < 8 && (value >> (4 * len)))
+		len++;
+	for (size_t i = len; i-- > 0; value >>= 4)
+		hex[i] = hex_pairs[2 * (value & 0xf) + 1];
+	hex[len] = 0;
+	return len;
+}
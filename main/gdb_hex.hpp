@@ -0,0 +1,19 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/* Table driven hex codec for the packet hot paths, drop-in replacements
+ * for hexify()/unhexify() from hex_utils.
+ */
+char *gdb_hexify(char *hex, const void *buf, size_t size);
+char *gdb_unhexify(void *buf, const char *hex, size_t size);
+
+/* Value of a single hex digit, -1 if c isn't one */
+int gdb_unhex_digit(char c);
+/* Parses hex digits at *str, leaving *str at the first non-digit */
+uint32_t gdb_hex_parse(const char **str);
+/* Parses "addr,len", returns the character following len or NULL if
+ * either number is missing */
+const char *gdb_hex_addr_len(const char *str, uint32_t *addr, uint32_t *len);
+/* Formats value without leading zeros, returns the number of digits */
+size_t gdb_hex_u32(char *hex, uint32_t value);
@@ -31,6 +31,7 @@
 #   include "lwip/netdb.h"
 #   include "lwip/dns.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 
 #include <timers.h>
 
@@ -40,37 +41,118 @@ extern "C" {
 }
 
 #include <string.h>
+#include <errno.h>
 #include <assert.h>
 
 #include "gdb_if.hpp"
 
-#define BUFFER_SIZE 256
+/* Target access is scheduled instead of going to whichever task the mutex
+ * wakes first. A released lock is handed straight to the longest waiting
+ * task of the most urgent class, so a client polling memory can't hold
+ * off another client's halt or flash write.
+ */
+struct lock_waiter {
+	xTaskHandle task;
+	lock_waiter *next;
+};
 
-static xSemaphoreHandle gdb_mutex;
+static xTaskHandle gdb_lock_owner;
 static int gdb_mutex_lockcount;
+static lock_waiter *lock_queue[GDB_LOCK_CLASSES];
+static struct gdb_lock_stats_s lock_stats;
 
-void gdb_lock() {
-	if(xSemaphoreGetMutexHolder(gdb_mutex) == xTaskGetCurrentTaskHandle()) {
+/* Class of the client the current task is serving, run control for the
+ * probe's own tasks */
+static gdb_lock_class gdb_task_class() {
+	void** ptr = (void**)pvTaskGetThreadLocalStoragePointer(NULL, 0);
+	if(ptr && ptr[0])
+		return ((GDB*)ptr[0])->lock_class;
+	return GDB_LOCK_RUN;
+}
+
+/* Takes the lock itself, only timing the wait when it is contended */
+static void gdb_mutex_take(gdb_lock_class cls) {
+	xTaskHandle me = xTaskGetCurrentTaskHandle();
+	lock_waiter w = { me, nullptr };
+
+	taskENTER_CRITICAL();
+	if(!gdb_lock_owner) {
+		gdb_lock_owner = me;
+		taskEXIT_CRITICAL();
+		lock_stats.acquired++;
+		return;
+	}
+	lock_waiter **tail = &lock_queue[cls];
+	while(*tail)
+		tail = &(*tail)->next;
+	*tail = &w;
+	taskEXIT_CRITICAL();
+
+	int64_t start = esp_timer_get_time();
+	while(gdb_lock_owner != me)
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+	uint32_t waited = esp_timer_get_time() - start;
+	lock_stats.acquired++;
+	lock_stats.contended++;
+	lock_stats.wait_us += waited;
+	if(waited > lock_stats.max_wait_us)
+		lock_stats.max_wait_us = waited;
+}
+
+static void gdb_mutex_give() {
+	taskENTER_CRITICAL();
+	lock_waiter *w = nullptr;
+	for(int cls = 0; cls < GDB_LOCK_CLASSES && !w; cls++) {
+		w = lock_queue[cls];
+		if(w)
+			lock_queue[cls] = w->next;
+	}
+	gdb_lock_owner = w ? w->task : nullptr;
+	if(w)
+		xTaskNotifyGive(w->task);
+	taskEXIT_CRITICAL();
+}
+
+void gdb_lock_stats(struct gdb_lock_stats_s *stats, bool reset) {
+	GDBLock lock;
+	*stats = lock_stats;
+	if(reset)
+		memset(&lock_stats, 0, sizeof(lock_stats));
+}
+
+void gdb_lock_throttled() {
+	GDBLock lock;
+	lock_stats.throttled++;
+}
+
+void gdb_lock(gdb_lock_class cls) {
+	if(gdb_lock_owner == xTaskGetCurrentTaskHandle()) {
 		gdb_mutex_lockcount++;
 	} else {
-		xSemaphoreTake(gdb_mutex, -1);
+		gdb_mutex_take(cls);
 		gdb_mutex_lockcount++;
 	}
 }
+void gdb_lock() {
+	if(gdb_lock_owner == xTaskGetCurrentTaskHandle())
+		gdb_mutex_lockcount++;
+	else
+		gdb_lock(gdb_task_class());
+}
 void gdb_unlock() {
-	if(xSemaphoreGetMutexHolder(gdb_mutex) == xTaskGetCurrentTaskHandle()) {
+	if(gdb_lock_owner == xTaskGetCurrentTaskHandle()) {
 		gdb_mutex_lockcount--;
 		if(gdb_mutex_lockcount == 0) {
-			xSemaphoreGive(gdb_mutex);
+			gdb_mutex_give();
 		}
 	}
 
 }
 int gdb_breaklock() {
-	if(xSemaphoreGetMutexHolder(gdb_mutex) == xTaskGetCurrentTaskHandle()) {
+	if(gdb_lock_owner == xTaskGetCurrentTaskHandle()) {
 		int state = gdb_mutex_lockcount;
 		gdb_mutex_lockcount = 0;
-		xSemaphoreGive(gdb_mutex);
+		gdb_mutex_give();
 		return state;
 	} else {
 		//ESP_LOGE("gdb_breaklock", "we're not the owner");
@@ -81,7 +163,7 @@ void gdb_restorelock(int state) {
 	if(state == 0) {
 		//ESP_LOGE("gdb_restorelock", "state 0");
 	} else {
-		xSemaphoreTake(gdb_mutex, -1);
+		gdb_mutex_take(gdb_task_class());
 		gdb_mutex_lockcount = state;
 	}
 }
@@ -96,9 +178,172 @@ struct exception** get_innermost_exception() {
     return (exception**)&ptr[1];
 }
 
+/* Connection state lives in GDB, the transport only moves spans. Waits
+ * drop the GDB lock and, on the connection's own task, the io_mutex so
+ * the halt poller can borrow the connection meanwhile. Input may then
+ * have been consumed by the time we get it back, reads never block.
+ */
+bool GDB::gdb_if_wait(int timeout)
+{
+	GDBBreakLock brk;
+	bool own = xTaskGetCurrentTaskHandle() == io_task;
+
+	if (own)
+		xSemaphoreGive(io_mutex);
+	bool ret = io->wait_input(timeout);
+	if (own)
+		xSemaphoreTake(io_mutex, portMAX_DELAY);
+	return ret;
+}
+
+/* Teardown is left to the connection's own task. Anyone else reading on
+ * its behalf unwinds to their exception handler instead. */
+void GDB::gdb_if_failed()
+{
+	io_failed = true;
+	tx_len = 0;
+	if (xTaskGetCurrentTaskHandle() == io_task)
+		gdb_if_closed();
+}
+
+/* Refills the receive buffer, false if nothing arrived within timeout */
+bool GDB::gdb_if_fill(int timeout)
+{
+	while (1) {
+		if (io_failed) {
+			gdb_if_failed();
+			raise_exception(EXCEPTION_ERROR, "GDB connection closed");
+		}
+		if (!gdb_if_wait(timeout))
+			return false;
+		int ret = io->read_some(rx_buf, sizeof(rx_buf));
+		if (ret > 0) {
+			rx_pos = 0;
+			rx_end = ret;
+			return true;
+		}
+		if (ret < 0)
+			gdb_if_failed();
+		else if (timeout >= 0)
+			return false;
+	}
+}
+
+/* The lock is only dropped in gdb_if_wait(), when we actually block */
+unsigned char GDB::gdb_if_getchar_to(int timeout)
+{
+	if (rx_pos < rx_end)
+		return rx_buf[rx_pos++];
+
+	if (gdb_if_fill(timeout))
+		return rx_buf[rx_pos++];
+
+	return 0xFF;
+}
+
+unsigned char GDB::gdb_if_getchar(void)
+{
+	while (rx_pos >= rx_end)
+		gdb_if_fill(-1);
+	return rx_buf[rx_pos++];
+}
+
+void GDB::gdb_if_putchar(unsigned char c, int flush)
+{
+	tx_buf[tx_len++] = c;
+	if (flush || (tx_len == tx_size))
+		gdb_if_flush();
+}
+
+void GDB::gdb_if_txcommit(size_t len, int flush)
+{
+	tx_len += len;
+	if (flush || (tx_len == tx_size))
+		gdb_if_flush();
+}
+
+void GDB::gdb_if_flush()
+{
+	if (tx_len && !io_failed) {
+		if (!io->write_all(tx_buf, tx_len) || !io->flush()) {
+			gdb_if_failed();
+			return;
+		}
+	}
+	tx_len = 0;
+}
+
+/* Takes the current packet size for this client and sizes the TX buffer
+ * to match. Only called between frames, when the TX buffer is empty. */
+void GDB::gdb_packet_size_adopt()
+{
+	size_t size = gdb_packet_size();
+	size_t want = size + 4;
+
+	pkt_size = size;
+	if (tx_len || (tx_buf && tx_size == want))
+		return;
+	if (tx_buf != tx_fallback)
+		free(tx_buf);
+	tx_buf = (uint8_t *)malloc(want);
+	tx_size = want;
+	if (!tx_buf) {
+		ESP_LOGW("GDB", "no memory for a %u byte TX buffer", (unsigned)want);
+		tx_buf = tx_fallback;
+		tx_size = sizeof(tx_fallback);
+	}
+}
+
+class GDB_tcp : public GDB_transport {
+public:
+	GDB_tcp(int sock) : sock(sock) {}
+
+	bool wait_input(int timeout) {
+		fd_set fds;
+		struct timeval tv;
+
+		tv.tv_sec = timeout / 1000;
+		tv.tv_usec = (timeout % 1000) * 1000;
+
+		FD_ZERO(&fds);
+		FD_SET(sock, &fds);
+		return select(sock+1, &fds, NULL, NULL, (timeout >= 0) ? &tv : NULL) > 0;
+	}
+
+	int read_some(void *buf, size_t len) {
+		int ret = recv(sock, buf, len, MSG_DONTWAIT);
+		if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 0;
+		return ret > 0 ? ret : -1;
+	}
+
+	bool write_all(const void *buf, size_t len) {
+		const uint8_t *p = (const uint8_t *)buf;
+		while (len) {
+			int ret = send(sock, p, len, 0);
+			if (ret <= 0)
+				return false;
+			p += ret;
+			len -= ret;
+		}
+		return true;
+	}
+
+	int sock;
+};
+
 class GDB_client : public GDB {
 public:
-	GDB_client(int sock) : sock(sock) {
+	GDB_client(int sock) : tcp(sock), sock(sock) {
+		io = &tcp;
+#ifdef CONFIG_GDB_SINGLE_TASK
+		pid = io_task = xTaskGetCurrentTaskHandle();
+		setup_socket();
+		num_clients++;
+		next = clients;
+		clients = this;
+		ESP_LOGI("GDB_client", "Accepted %d this:%p", sock, this);
+#else
 		char name[32];
 		snprintf(name, 32, "gdbc fd:%d", sock);
 
@@ -106,16 +351,10 @@ public:
 			GDB_client* _this = (GDB_client*)arg;
 			_this->task();
 		}, name, 3500, this, 1, &pid);
+#endif
 	}
 
-
-	void task() {
-		void* tls[2] = {};
-		tls[0] = this;
-		vTaskSetThreadLocalStoragePointer(0, 0, tls); //used for exception handling
-		
-		ESP_LOGI("GDB_client", "Started task %d this:%p tlsp:%p mowner:%p", sock, this, tls, xQueueGetMutexHolder(gdb_mutex));
-
+	void setup_socket() {
 		int opt = 1;
 		setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (void*)&opt, sizeof(opt));
 		opt = 1; /* SO_KEEPALIVE */
@@ -126,8 +365,108 @@ public:
 		setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, (void *)&opt, sizeof(opt));
 		opt = 3; /* TCP_KEEPCNT */
 		setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, (void *)&opt, sizeof(opt));
-		opt = 1;
+	}
+
+#ifdef CONFIG_GDB_SINGLE_TASK
+	/* One task serves every connection: the sockets are multiplexed with
+	 * select() and each client's input goes through its resumable packet
+	 * parser, so a connection costs its buffers rather than a task stack.
+	 * Packet handlers still run to completion, a long target operation or
+	 * a semihosting exchange holds up the other clients meanwhile.
+	 */
+	static void serve(int serv) {
+		void* tls[2] = {};
+		vTaskSetThreadLocalStoragePointer(0, 0, tls); //used for exception handling
+
+		while (1) {
+			fd_set fds;
+			struct timeval tv = { 0, 20 * 1000 };
+			int maxfd = serv;
+
+			FD_ZERO(&fds);
+			FD_SET(serv, &fds);
+			for (GDB_client *c = clients; c; c = c->next) {
+				/* Input left over for lack of a packet buffer is retried
+				 * on the next round, selecting on it would just spin */
+				if (c->rx_pos < c->rx_end)
+					continue;
+				FD_SET(c->sock, &fds);
+				if (c->sock > maxfd)
+					maxfd = c->sock;
+			}
+
+			int n = select(maxfd + 1, &fds, NULL, NULL, &tv);
+			if (n < 0)
+				FD_ZERO(&fds);
+
+			for (GDB_client **p = &clients; *p; ) {
+				GDB_client *c = *p;
+				c->service(tls, FD_ISSET(c->sock, &fds));
+				if (c->closed) {
+					*p = c->next;
+					c->release();
+					delete c;
+				} else {
+					p = &c->next;
+				}
+			}
+
+			if (FD_ISSET(serv, &fds)) {
+				int s = accept(serv, NULL, NULL);
+				if(s > 0)
+					new GDB_client(s);
+			}
+		}
+	}
+
+	void service(void **tls, bool readable) {
+		tls[0] = this;
+		xSemaphoreTake(io_mutex, portMAX_DELAY);
+
+		volatile struct exception e;
+		TRY_CATCH(e, EXCEPTION_ALL) {
+			if (!started) {
+				started = true;
+				gdb_session_start();
+			}
+			if (readable && rx_pos >= rx_end)
+				gdb_if_fill(0);
+
+			int size;
+			do {
+				gdb_pbuf_release();
+				size = gdb_rx_poll();
+				if (size > 0)
+					gdb_main_packet(size);
+			} while (size > 0);
+
+			gdb_ack_poll();
+			gdb_idle();
+		}
+		if (e.type && !closed) {
+			gdb_putpacketz("EFF");
+			GDB_LOCK();
+			target_list_free();
+			ESP_LOGI("Exception", "TARGET LOST e.type:%d", e.type);
+		}
+		/* Unwinding skips the GDBLock destructors, nothing may be held
+		 * between clients */
+		gdb_breaklock();
 
+		tls[0] = nullptr;
+		xSemaphoreGive(io_mutex);
+	}
+#else
+	void task() {
+		void* tls[2] = {};
+		tls[0] = this;
+		vTaskSetThreadLocalStoragePointer(0, 0, tls); //used for exception handling
+		io_task = xTaskGetCurrentTaskHandle();
+		xSemaphoreTake(io_mutex, portMAX_DELAY);
+		
+		ESP_LOGI("GDB_client", "Started task %d this:%p tlsp:%p mowner:%p", sock, this, tls, gdb_lock_owner);
+
+		setup_socket();
 		num_clients++;
 
 		while (true) {
@@ -146,6 +485,7 @@ public:
 
 		destroy(); //just in case
 	}
+#endif
 	
 	int fileno() {
 		return sock;
@@ -156,86 +496,50 @@ private:
 		ESP_LOGI("GDB_client", "delete %p", this);
 	}
 
-	void destroy() {
-		ESP_LOGI("GDB_client", "destroy %d", sock);
-		num_clients--;
+	void release() {
+		{
+			GDB_LOCK();
+			/* Before the poller is told, it exits with the last client */
+			num_clients--;
+			halt_poll_forget();
+			watch_forget();
+		}
 
 		gdb_breaklock();
+		/* Not before, the pipeline task needs the lock to finish */
+		flash_forget();
 		close(sock);
+	}
+
+	void gdb_if_closed() {
+		destroy();
+	}
+
+	void destroy() {
+		ESP_LOGI("GDB_client", "destroy %d", sock);
+#ifdef CONFIG_GDB_SINGLE_TASK
+		/* Unwind to the event loop, which drops the connection */
+		closed = true;
+		raise_exception(EXCEPTION_ERROR, "GDB connection closed");
+#else
+		release();
 
 		xTimerPendFunctionCall([](void * _this, uint32_t ulParameter2) {
 			GDB_client* c = (GDB_client*)_this;
 			delete c;
 		 }, this, 0, -1);
 		vTaskDelete(pid);
+#endif
 	}
 
-	unsigned char gdb_if_getchar_to(int timeout) {
-		GDBBreakLock brk;
-		if (buffer_index < buffer_size) {
-			char c = buffer[buffer_index++];
-			return c;
-		}
-
-		fd_set fds;
-		struct timeval tv;
-
-		tv.tv_sec = timeout / 1000;
-		tv.tv_usec = (timeout % 1000) * 1000;
-
-		FD_ZERO(&fds);
-		FD_SET(sock, &fds);
-		
-		if(select(sock+1, &fds, NULL, NULL, (timeout >= 0) ? &tv : NULL) > 0) {
-			char c = gdb_if_getchar();
-			return c;
-		}
-
-		return 0xFF;
-	}
-
-	unsigned char gdb_if_getchar(void) {
-		if (buffer_index >= buffer_size) {
-			int ret = recv(sock, buffer, BUFFER_SIZE, 0);
-
-			if (ret <= 0) {
-				destroy();
-				// should not be reached
-				return 0;
-			}
-
-			buffer_size = ret;
-			buffer_index = 0;
-		}
-
-		// Get the next character from the buffer
-		unsigned char next_char = buffer[buffer_index++];
-
-		// You can add additional processing here if needed
-
-		return next_char;
-	}
-    void gdb_if_putchar(unsigned char c, int flush) {
-		buf[bufsize++] = c;
-		if (flush || (bufsize == sizeof(buf))) {
-			if (sock > 0) {
-				int ret = send(sock, buf, bufsize, 0);
-				if(ret <= 0) {
-					destroy();
-					//should not be reached
-					return;
-				}
-			}
-			bufsize = 0;
-		}
-	}
-
-	uint8_t buf[256];
-	int bufsize = 0;
+	GDB_tcp tcp;
 	xTaskHandle pid;
-	unsigned char buffer[BUFFER_SIZE];
-	int buffer_index = 0;
-	int buffer_size = 0;
+#ifdef CONFIG_GDB_SINGLE_TASK
+	bool started = false;
+	bool closed = false;
+	GDB_client *next = nullptr;
+	inline static GDB_client *clients = nullptr;
+#endif
 	int sock;
 };
 
@@ -244,7 +548,8 @@ void gdb_net_task(void* arg) {
 	struct sockaddr_in addr;
 	int opt;
 
-	gdb_mutex = xSemaphoreCreateMutex();
+	gdb_bufpool_init();
+	GDB::halt_poll_init();
 
 	addr.sin_family = AF_INET;
 	addr.sin_port = htons(2022);
@@ -261,11 +566,15 @@ void gdb_net_task(void* arg) {
 	ESP_LOGI("GDB", "Listening on TCP:2022\n");
 
 
+#ifdef CONFIG_GDB_SINGLE_TASK
+	GDB_client::serve(gdb_if_serv);
+#else
 	while(1) {
 		int s = accept(gdb_if_serv, NULL, NULL);
 		if(s > 0)
 			new GDB_client(s);
 	}
+#endif
 
 }
 
@@ -325,7 +634,7 @@ void gdb_putpacket(const char *packet, size_t size) {
 	void** ptr = (void**)pvTaskGetThreadLocalStoragePointer(NULL, 0);
 	assert(ptr);
 	GDB* _this = (GDB*)ptr[0];
-	_this->gdb_putpacket_f(packet, size);
+	_this->gdb_putpacket(packet, size);
 }
 
 extern "C"
@@ -343,7 +652,7 @@ void gdb_putpacket_f(const char *fmt, ...) {
 	void** ptr = (void**)pvTaskGetThreadLocalStoragePointer(NULL, 0);
 	assert(ptr);
 	GDB* _this = (GDB*)ptr[0];
-	_this->gdb_putpacket_f(fmt, ap);
+	_this->gdb_vputpacket_f('$', fmt, ap);
 	va_end(ap);
 }
 
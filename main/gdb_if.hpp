@@ -1,22 +1,52 @@
 #pragma once
 #include <stdarg.h>
-#define BUF_SIZE	1024
+#include <stdlib.h>
+#define GDB_RX_BUFFER_SIZE	256
+/* TX buffer used when one of the client's packet size can't be had,
+ * frames that don't fit go out in pieces */
+#define GDB_TX_BUFFER_MIN	64
 #include "FreeRTOS.h"
 #include "semphr.h"
+#include "task.h"
+#include "gdb_bufpool.hpp"
+#include "gdb_transport.hpp"
 extern "C" {
 #include "gdb_packet.h"
 int gdb_main_loop(struct target_controller * tc, bool in_syscall);
 }
 
+/* Target access classes, most urgent first. A contended lock goes to the
+ * longest waiting task of the most urgent class. */
+enum gdb_lock_class {
+    GDB_LOCK_RUN,       /* halt, resume, breakpoints, reset */
+    GDB_LOCK_FLASH,     /* flash programming and memory/register writes */
+    GDB_LOCK_READ,      /* memory and register reads */
+    GDB_LOCK_CLASSES
+};
+
 void gdb_lock();
+void gdb_lock(gdb_lock_class cls);
 void gdb_unlock();
 int gdb_breaklock();
 void gdb_restorelock(int state);
 
+struct gdb_lock_stats_s {
+    uint32_t acquired;      /* times the mutex was taken */
+    uint32_t contended;     /* of those, how many had to wait */
+    uint64_t wait_us;
+    uint32_t max_wait_us;
+    uint32_t throttled;     /* reads delayed by a client's rate limit */
+};
+void gdb_lock_stats(struct gdb_lock_stats_s *stats, bool reset);
+void gdb_lock_throttled();
+
 struct GDBLock {
     GDBLock(){
         gdb_lock();
     }
+    GDBLock(gdb_lock_class cls){
+        gdb_lock(cls);
+    }
     ~GDBLock() {
         gdb_unlock();
     }
@@ -33,46 +63,180 @@ struct GDBBreakLock {
 
 class GDB {
 public:
+    GDB() { io_mutex = xSemaphoreCreateMutex(); gdb_packet_size_adopt(); }
     void gdb_main(void);
-    virtual ~GDB() {};
+    virtual ~GDB() {
+        gdb_bufpool_put(pbuf);
+        free(retx_buf);
+        if (tx_buf != tx_fallback)
+            free(tx_buf);
+        vSemaphoreDelete(io_mutex);
+    };
 
-    virtual unsigned char gdb_if_getchar(void) = 0;
-    virtual void gdb_if_putchar(unsigned char c, int flush) = 0;
-    virtual unsigned char gdb_if_getchar_to(int timeout) = 0;
-    void gdb_next_char(const char c, uint8_t *const csum);
+    static void halt_poll_init();
 
-    int gdb_getpacket(char *packet, int size);
+    unsigned char gdb_if_getchar(void);
+    void gdb_if_putchar(unsigned char c, int flush);
+    unsigned char gdb_if_getchar_to(int timeout);
+    /* Contiguous span of already received bytes, consumed without blocking */
+    size_t gdb_if_rxspan(const unsigned char **data) {
+        *data = rx_buf + rx_pos;
+        return rx_end - rx_pos;
+    }
+    void gdb_if_rxconsume(size_t len) { rx_pos += len; }
+    /* Free space at the tail of the TX buffer; commit queues len bytes of
+     * it and sends the buffer when flush is set or it is full */
+    uint8_t *gdb_if_txspace(size_t *avail) {
+        *avail = tx_size - tx_len;
+        return tx_buf + tx_len;
+    }
+    void gdb_if_txcommit(size_t len, int flush);
+    void gdb_if_flush();
+    bool gdb_if_fill(int timeout);
+
+    void gdb_frame_begin(char pktstart);
+    void gdb_frame_append(const void *data, size_t len);
+    void gdb_frame_end();
+    void gdb_tx_commit(const uint8_t *data, size_t len, int flush);
+    void gdb_retransmit();
+    void gdb_ack_received(bool ack);
+    void gdb_ack_poll();
+    void gdb_ack_wait();
+    bool gdb_ack_ready();
+    bool gdb_retx_grow(size_t need);
+
+    int gdb_getpacket();
     void gdb_putpacket(const char *packet, int size, char pktstart = '$');
     void gdb_putpacket2(const char *const packet1, const size_t size1, const char *const packet2, const size_t size2);
+    void gdb_vputpacket_f(char pktstart, const char *fmt, va_list ap);
     void gdb_putpacket_f(const char *fmt, ...);
     void gdb_putnotifpacket_f(const char *fmt, ...);
     void gdb_put_notification(const char *const packet, const size_t size);
 
+    void gdb_out_n(const char *buf, size_t len);
     void gdb_out(const char *buf);
     void gdb_voutf(const char *fmt, va_list ap);
     void gdb_outf(const char *fmt, ...);
 
     virtual int fileno() = 0;
 
+    bool watch_command(int argc, const char **argv);
+
     bool gdb_needs_detach_notify = false;
+    /* Class of the target access this client is doing right now */
+    gdb_lock_class lock_class = GDB_LOCK_RUN;
+#ifdef CONFIG_GDB_RLE
+    bool rle_enabled = true;
+#else
+    bool rle_enabled = false;
+#endif
 
 protected:
+    /* Connection gone, called on the connection's own task only */
+    virtual void gdb_if_closed() = 0;
+    bool gdb_if_wait(int timeout);
+    void gdb_if_failed();
+
+    GDB_transport *io = nullptr;
+    xTaskHandle io_task = nullptr;
+    bool io_failed = false;
+    uint8_t rx_buf[GDB_RX_BUFFER_SIZE];
+    size_t rx_pos = 0;
+    size_t rx_end = 0;
+    /* Holds a frame of pkt_size payload plus '$' and "#xx" */
+    uint8_t *tx_buf = nullptr;
+    size_t tx_size = 0;
+    size_t tx_len = 0;
+    uint8_t tx_fallback[GDB_TX_BUFFER_MIN];
+    /* Packet size this client was offered in qSupported */
+    size_t pkt_size = 0;
+    void gdb_packet_size_adopt();
+
     friend int ::gdb_main_loop(struct target_controller * tc, bool in_syscall);
     void handle_q_packet(char *packet, int len);
     void handle_v_packet(char *packet, int plen);
     void handle_z_packet(char *packet, int plen);
     int gdb_main_loop(struct target_controller *tc, bool in_syscall);
+    void gdb_session_start();
+    bool gdb_handle_packet(struct target_controller *tc, bool in_syscall, int size, int *ret);
+    void gdb_main_packet(int size);
+    void gdb_idle();
+    void gdb_read_throttle();
     void handle_q_string_reply(const char *str, const char *param);
 
-    char pbuf[BUF_SIZE+1];
+    /* Halt detection, shared by all clients through one poller task */
+    static void halt_poll_task(void *arg);
+    void halt_poll_start();
+    void halt_poll_forget();
+    void gdb_halt_report();
+
+    /* Probe side sampling of "monitor watch" entries */
+    static void watch_task(void *arg);
+    void watch_forget();
+    bool watch_report(uint32_t ms, uint32_t addr, const uint8_t *data, size_t size);
+
+    /* One flash load at a time, the pipeline and the incremental state
+     * belong to the client that started it */
+    bool flash_claim();
+    void flash_forget();
+
+    enum rx_state_e : uint8_t {
+        RX_IDLE, RX_DATA, RX_ESCAPE, RX_CSUM_HI, RX_CSUM_LO, RX_REMOTE,
+        RX_DISCARD, RX_DISCARD_CSUM
+    };
+    enum rx_event_e : uint8_t {
+        RX_EV_NONE, RX_EV_PACKET, RX_EV_INTERRUPT, RX_EV_REMOTE, RX_EV_NOBUF
+    };
+    size_t gdb_rx_feed(const unsigned char *data, size_t len);
+    void gdb_rx_overflow();
+    int gdb_rx_event();
+    int gdb_rx_poll();
+    bool gdb_pbuf_acquire(bool wait);
+    void gdb_pbuf_release();
+
+    rx_state_e rx_state = RX_IDLE;
+    rx_event_e rx_event = RX_EV_NONE;
+    uint8_t rx_csum = 0;
+    int16_t rx_recv_csum = 0;  /* -1 after a non-hex digit */
+    int rx_len = 0;
+    uint8_t tx_csum = 0;
+    bool tx_track = false;
+
+    /* Frame waiting for a '+', resent on '-' or timeout */
+    uint8_t *retx_buf = nullptr;
+    size_t retx_size = 0;
+    size_t retx_len = 0;
+    uint32_t retx_time = 0;
+    uint8_t retx_tries = 0;
+    bool retx_lost = false;
+    bool ack_pending = false;
+
+    /* Packet buffer from the shared pool, held from the start of a frame
+     * until the packet has been handled */
+    char *pbuf = nullptr;
+    size_t pbuf_size = 0;
     bool non_stop = 0;
     bool no_ack_mode = 0;
     
 	bool single_step = false;
 	bool run_state = false;
 
+    /* Held by the client task whenever it isn't waiting for input, the
+     * poller borrows it to poll and report on this connection */
+    xSemaphoreHandle io_mutex;
+    uint32_t halt_seen = 0;
+    bool halt_waiting = false;
+    GDB *halt_next = nullptr;
+
+    /* Token bucket for reads, in 1/configTICK_RATE_HZ tokens */
+    uint32_t read_credit = CONFIG_GDB_READ_BURST * configTICK_RATE_HZ;
+    TickType_t read_refill = 0;
+
+
+    uint8_t flash_mode = 0;
 
     inline static  int num_clients = 0;
+    inline static GDB *flash_owner = nullptr;
 };
 
 #define GDB_LOCK() GDBLock gdb_lock
@@ -0,0 +1,78 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "gdb_transport.hpp"
+
+/* In-memory transport, one end of a pair: what one end writes the other
+ * reads. Meant for tests, everything runs in the caller's thread, so
+ * wait_input() never blocks and a write that doesn't fit in the peer's
+ * buffer fails instead of waiting for it to drain.
+ */
+class GDB_loopback : public GDB_transport {
+public:
+    static const size_t CAPACITY = 4096;
+
+    void connect(GDB_loopback *other) {
+        peer = other;
+        other->peer = this;
+    }
+
+    /* The peer reads what is still buffered, then gets -1 */
+    void close() {
+        closed = true;
+        if (peer)
+            peer->peer_closed = true;
+    }
+
+    bool wait_input(int timeout) {
+        (void)timeout;
+        return len || peer_closed;
+    }
+
+    int read_some(void *buf, size_t size) {
+        if (!len)
+            return peer_closed ? -1 : 0;
+        size_t n = size < len ? size : len;
+        for (size_t done = 0; done < n; ) {
+            /* At most two spans, up to the end of the ring and from its start */
+            size_t span = CAPACITY - head;
+            if (span > n - done)
+                span = n - done;
+            memcpy((uint8_t *)buf + done, data + head, span);
+            head = (head + span) % CAPACITY;
+            done += span;
+        }
+        len -= n;
+        return n;
+    }
+
+    bool write_all(const void *buf, size_t size) {
+        if (closed || !peer || peer->closed || size > CAPACITY - peer->len)
+            return false;
+        const uint8_t *p = (const uint8_t *)buf;
+        while (size) {
+            size_t tail = (peer->head + peer->len) % CAPACITY;
+            size_t span = CAPACITY - tail;
+            if (span > size)
+                span = size;
+            memcpy(peer->data + tail, p, span);
+            peer->len += span;
+            p += span;
+            size -= span;
+        }
+        return true;
+    }
+
+    /* Bytes waiting to be read on this end */
+    size_t pending() const { return len; }
+
+private:
+    GDB_loopback *peer = nullptr;
+    bool closed = false;
+    bool peer_closed = false;
+    uint8_t data[CAPACITY];
+    size_t head = 0;
+    size_t len = 0;
+};
@@ -42,6 +42,12 @@ extern "C" {
 }
 
 #include "gdb_if.hpp"
+#include "gdb_hex.hpp"
+#include "gdb_memcache.hpp"
+#include "gdb_flashpipe.hpp"
+#include "gdb_flashinc.hpp"
+#include "gdb_crc.hpp"
+#include "gdb_swdtune.hpp"
 #include "task.h"
 
 enum gdb_signal {
@@ -81,6 +87,7 @@ void gdb_target_destroy_callback(struct target_controller *tc, target *t)
 
 	if (last_target == t)
 		last_target = NULL;
+	gdb_mem_cache_invalidate();
 }
 
 void gdb_target_printf(struct target_controller *tc,
@@ -92,7 +99,9 @@ void gdb_target_printf(struct target_controller *tc,
 	void** ptr = (void**)pvTaskGetThreadLocalStoragePointer(NULL, 0);
 	assert(ptr);
 	GDB* _this = (GDB*)ptr[0];
-	_this->gdb_voutf(fmt, ap);
+	/* Background tasks like flash programming have no client */
+	if (_this)
+		_this->gdb_voutf(fmt, ap);
 }
 
 static struct target_controller gdb_controller = {
@@ -128,11 +137,55 @@ static bool cmd_reset(target *t, int argc, const char **argv) {
 	return true;
 }
 
+static bool cmd_watch(target *t, int argc, const char **argv) {
+	(void)t;
+	void** ptr = (void**)pvTaskGetThreadLocalStoragePointer(NULL, 0);
+	assert(ptr);
+	GDB* _this = (GDB*)ptr[0];
+
+	return _this->watch_command(argc, argv);
+}
+
+static bool cmd_packetsize(target *t, int argc, const char **argv) {
+	(void)t;
+	if (argc == 2) {
+		if (!gdb_packet_size_set(strtoul(argv[1], NULL, 0))) {
+			gdb_outf("Packet size must be %d..%d and fit in the free heap\n",
+				GDB_PACKET_SIZE_MIN, GDB_PACKET_SIZE_MAX);
+			return false;
+		}
+		gdb_outf("Reconnect GDB to use the new packet size\n");
+	}
+	gdb_outf("Packet size: %u\n", (unsigned)gdb_packet_size());
+	return true;
+}
+
+static bool cmd_rle(target *t, int argc, const char **argv) {
+	(void)t;
+	void** ptr = (void**)pvTaskGetThreadLocalStoragePointer(NULL, 0);
+	assert(ptr);
+	GDB* _this = (GDB*)ptr[0];
+
+	if (argc == 2)
+		_this->rle_enabled = !strcmp(argv[1], "enable");
+	gdb_outf("Run-length encoding: %s\n", _this->rle_enabled ? "enabled" : "disabled");
+	return true;
+}
+
+static bool cmd_lockstats(target *t, int argc, const char **argv) {
+	(void)t;
+	struct gdb_lock_stats_s st;
+	gdb_lock_stats(&st, argc == 2 && !strcmp(argv[1], "reset"));
+	gdb_outf("Target lock: %u taken, %u contended, %u ms waited, %u us longest wait, %u reads throttled\n",
+		st.acquired, st.contended, (uint32_t)(st.wait_us / 1000), st.max_wait_us, st.throttled);
+	return true;
+}
+
 static bool cmd_write_dp(target *t, int argc, const char **argv) {
 	char* buf = "O.K.\n";
 	int i;
 	char hexdata[((i = strlen(buf)*2 + 1) + 1)];
-	hexify(hexdata, buf, strlen(buf));
+	gdb_hexify(hexdata, buf, strlen(buf));
 	gdb_putpacket(hexdata, i);
 
 	uint32_t addr = strtoul(argv[1], 0, 16);
@@ -143,6 +196,43 @@ static bool cmd_write_dp(target *t, int argc, const char **argv) {
 	return 255;
 }
 
+/* Block transfers on Cortex-M targets go through the queued SW-DP path.
+ * swdp_queue_attach() leaves DPs alone unless they use the SWD low level
+ * access, a target found by "monitor jtag_scan" keeps the plain hooks. */
+static void gdb_attach_hooks(target *t)
+{
+#ifdef CONFIG_SWD_QUEUE
+	if (t && t->core && t->core[0] == 'M')
+		swdp_queue_attach(cortexm_ap(t)->dp);
+#else
+	(void)t;
+#endif
+}
+
+#ifdef CONFIG_GDB_TARGET_CACHE
+/* True when the DP, AP and core of a target found by an earlier scan
+ * still answer with the same IDs, so a new connection can skip the scan.
+ * A power cycle drops debug power and fails the check, a plain system
+ * reset keeps all of it and passes. Another part of the same family
+ * swapped in meanwhile may pass too, hence off by default.
+ */
+static bool gdb_target_cached(target *t)
+{
+	if (!t || !t->core || t->core[0] != 'M')
+		return false;
+	adiv5_access_port_s *ap = cortexm_ap(t);
+	bool same = false;
+	volatile struct exception e;
+	TRY_CATCH (e, EXCEPTION_ALL) {
+		same = adiv5_dp_read(ap->dp, ADIV5_DP_IDCODE) == ap->dp->debug_port_id &&
+		       (adiv5_dp_read(ap->dp, ADIV5_DP_CTRLSTAT) & ADIV5_DP_CTRLSTAT_CDBGPWRUPACK) &&
+		       adiv5_ap_read(ap, ADIV5_AP_IDR) == ap->idr &&
+		       target_mem_read32(t, CORTEXM_CPUID) == t->cpuid;
+	}
+	return same && !e.type;
+}
+#endif
+
 static bool cmd_read_ap(target *t, int argc, const char **argv) {
 	if(!cur_target) {
 		return false;
@@ -157,407 +247,920 @@ static bool cmd_read_ap(target *t, int argc, const char **argv) {
 	asprintf(&buf, "O.K.:0x%08x\n", reg);
 	int i;
 	char hexdata[((i = strlen(buf)*2 + 1) + 1)];
-	hexify(hexdata, buf, strlen(buf));
+	gdb_hexify(hexdata, buf, strlen(buf));
 	gdb_putpacket(hexdata, i);
 	free(buf);
 	return 255;
 }
 
-int GDB::gdb_main_loop(struct target_controller *tc, bool in_syscall)
+/* Halt detection is owned by a single poller task. It polls quickly right
+ * after a resume, backs off while the target keeps running, and records
+ * the halt for every client waiting on the target. Each client sends its
+ * stop reply from its own idle path, which runs at least every 20 ms: a
+ * send from the poller could wait out an ack, or unwind on a closed
+ * connection, while it holds another client's io_mutex.
+ *
+ * Polling runs with the connection of the client that last resumed the
+ * target borrowed, so target output and semihosting requests raised from
+ * target_halt_poll() reach that client like they did before.
+ */
+#define HALT_POLL_MIN_MS	4
+#define HALT_POLL_MAX_MS	128
+/* Semihosting from target_halt_poll() runs GDB exchanges on this stack */
+#define HALT_POLL_STACK		3072
+
+static xSemaphoreHandle halt_poll_wake;
+/* Started by the first resume, gone once the last client has left */
+static xTaskHandle halt_poll_handle;
+static GDB *halt_waiters;	/* newest first, the head owns the poll */
+static uint32_t halt_seq;
+static enum target_halt_reason halt_reason;
+static target_addr_t halt_watch;
+static bool halt_running;
+static uint32_t halt_poll_ms;
+
+/* All halt state is protected by the GDB lock */
+void GDB::halt_poll_forget()
 {
-	
-	{
-		GDB_LOCK();
-	    ESP_LOGI(__func__, "cur_target=%p last_target=%p\n", cur_target, last_target);
-		if((!cur_target && !last_target) || num_clients == 1) {
-			ESP_LOGI("GDB", "Scanning SWD");
-			int devs = -1;
-			volatile struct exception e;
-			TRY_CATCH (e, EXCEPTION_ALL) {
-				devs = adiv5_swdp_scan(0);
-				ESP_LOGI("GDB", "Found %d", devs);
-				if(devs > 0) {
-					cur_target = target_attach_n(1, &gdb_controller);
-					if(cur_target) {
-						static const command_s cmds[]  = { 
-							{"reset", cmd_reset, "OpenOCD style target reset: reset [init halt run]"}, 
-							{"WriteDP", cmd_write_dp, "STLINK helper"},
-							{"ReadAP", cmd_read_ap, "STLINK helper"},
-
-							{0,0,0} 
-						};
-						target_add_commands(cur_target, cmds, "Target");
-					}
-				}
-			}
-			switch (e.type) {
-			case EXCEPTION_TIMEOUT:
-				ESP_LOGI("GDB", "Timeout during scan. Is target stuck in WFI?\n");
-				break;
-			case EXCEPTION_ERROR:
-				ESP_LOGI("GDB", "Exception: %s\n", e.msg);
-				break;
-			}
+	for (GDB **p = &halt_waiters; *p; p = &(*p)->halt_next) {
+		if (*p == this) {
+			*p = halt_next;
+			break;
 		}
 	}
+	halt_next = nullptr;
+	halt_waiting = false;
+	if (!halt_waiters) {
+		halt_running = false;
+		/* Lets an idle poller see that no client is left */
+		xSemaphoreGive(halt_poll_wake);
+	}
+}
 
-	int size;
-
-	/* GDB protocol main loop */
-	while(1) {
-		SET_IDLE_STATE(1);
-		size = gdb_getpacket(pbuf, BUF_SIZE);
-		if(size == 0) {
-			GDB_LOCK();
-			if(run_state && cur_target) {
-				target_addr_t watch;
-				enum target_halt_reason reason = TARGET_HALT_RUNNING;
-				reason = target_halt_poll(cur_target, &watch);
-
-				if(non_stop) {
-					// if(reason)
-					// 	DEBUG_GDB("send state %d", reason);
-					switch (reason) {
-					case TARGET_HALT_ERROR:
-						DEBUG_WARN("target_halt_poll = TARGET_HALT_ERROR");
-						gdb_putnotifpacket_f("Stop:X%02X", GDB_SIGLOST);
-						break;
-					case TARGET_HALT_REQUEST:
-						gdb_putnotifpacket_f("Stop:T%02Xthread:1;core:0;", GDB_SIGINT);
-						break;
-					case TARGET_HALT_WATCHPOINT:
-						gdb_putnotifpacket_f("Stop:T%02Xthread:1;core:0;watch:%08X;", GDB_SIGTRAP, watch);
-						break;
-					case TARGET_HALT_FAULT:
-						gdb_putnotifpacket_f("Stop:T%02Xthread:1;core:0;", GDB_SIGSEGV);
-						break;
-					case TARGET_HALT_RUNNING:
-						break;
-					default:
-						gdb_putnotifpacket_f("Stop:T%02Xthread:1;core:0;", GDB_SIGTRAP);
-						break;
-					}		
-					
-				} else {
-					switch (reason) {
-					case TARGET_HALT_ERROR:
-						gdb_putpacket_f("X%02X", GDB_SIGLOST);
-						break;
-					case TARGET_HALT_REQUEST:
-						gdb_putpacket_f("T%02X", GDB_SIGINT);
-						break;
-					case TARGET_HALT_WATCHPOINT:
-						gdb_putpacket_f("T%02Xwatch:%08X;", GDB_SIGTRAP, watch);
-						break;
-					case TARGET_HALT_FAULT:
-						gdb_putpacket_f("T%02X", GDB_SIGSEGV);
-						break;
-					case TARGET_HALT_RUNNING:
-						break;
-					default:
-						gdb_putpacket_f("T%02X", GDB_SIGTRAP);
-						break;
-					}
-				}
-				if(run_state && reason != TARGET_HALT_RUNNING) {
-					run_state = false;
-					single_step = false;
-				} 
+void GDB::halt_poll_start()
+{
+	if (halt_waiting)
+		halt_poll_forget();
+	halt_next = halt_waiters;
+	halt_waiters = this;
+	halt_waiting = true;
+	halt_seen = halt_seq;
+
+	halt_running = true;
+	halt_poll_ms = HALT_POLL_MIN_MS;
+	if (!halt_poll_handle &&
+	    xTaskCreate(halt_poll_task, "halt_poll", HALT_POLL_STACK, NULL, 1, &halt_poll_handle) != pdPASS) {
+		halt_poll_handle = nullptr;
+		ESP_LOGE("GDB", "no memory for the halt poller");
+	}
+	xSemaphoreGive(halt_poll_wake);
+}
 
-			}
+void GDB::gdb_halt_report()
+{
+	if (!run_state || halt_seen == halt_seq)
+		return;
+	halt_seen = halt_seq;
 
-			continue;
-		} 
-		SET_IDLE_STATE(0);
-		switch(pbuf[0]) {
-		/* Implementation of these is mandatory! */
-		case 'g': { /* 'g': Read general registers */
-			ERROR_IF_NO_TARGET();
-			uint8_t gp_regs[target_regs_size(cur_target)];
-			target_regs_read(cur_target, gp_regs);
-			gdb_putpacket(hexify(pbuf, gp_regs, sizeof(gp_regs)), sizeof(gp_regs) * 2U);
+	if(non_stop) {
+		switch (halt_reason) {
+		case TARGET_HALT_ERROR:
+			DEBUG_WARN("target_halt_poll = TARGET_HALT_ERROR");
+			gdb_putnotifpacket_f("Stop:X%02X", GDB_SIGLOST);
 			break;
-			}
-		case 'T': //thread select
-			gdb_putpacketz("OK");
+		case TARGET_HALT_REQUEST:
+			gdb_putnotifpacket_f("Stop:T%02Xthread:1;core:0;", GDB_SIGINT);
 			break;
-		case 'm': {	/* 'm addr,len': Read len bytes from addr */
-			uint32_t addr, len;
-			ERROR_IF_NO_TARGET();
-			sscanf(pbuf, "m%" SCNx32 ",%" SCNx32, &addr, &len);
-			if (len > sizeof(pbuf) / 2) {
-				gdb_putpacketz("E02");
-				break;
-			}
-			DEBUG_GDB("m packet: addr = %" PRIx32 ", len = %" PRIx32 "\n",
-					  addr, len);
-			uint8_t mem[len];
-			if (target_mem_read(cur_target, mem, addr, len)) {
-				DEBUG_WARN("target_mem_read error");
-				gdb_putpacketz("E01");
-			} else
-				gdb_putpacket(hexify(pbuf, mem, len), len*2);
+		case TARGET_HALT_WATCHPOINT:
+			gdb_putnotifpacket_f("Stop:T%02Xthread:1;core:0;watch:%08X;", GDB_SIGTRAP, halt_watch);
 			break;
-			}
-		case 'G': {	/* 'G XX': Write general registers */
-			ERROR_IF_NO_TARGET();
-			uint8_t arm_regs[target_regs_size(cur_target)];
-			unhexify(arm_regs, &pbuf[1], sizeof(arm_regs));
-			target_regs_write(cur_target, arm_regs);
-			gdb_putpacketz("OK");
+		case TARGET_HALT_FAULT:
+			gdb_putnotifpacket_f("Stop:T%02Xthread:1;core:0;", GDB_SIGSEGV);
 			break;
-			}
-		case 'H': //select thread: Hc0, Hg-1
-			gdb_putpacketz("OK");
+		default:
+			gdb_putnotifpacket_f("Stop:T%02Xthread:1;core:0;", GDB_SIGTRAP);
 			break;
-		case 'M': { /* 'M addr,len:XX': Write len bytes to addr */
-			uint32_t addr, len;
-			int hex;
-			ERROR_IF_NO_TARGET();
-			sscanf(pbuf, "M%" SCNx32 ",%" SCNx32 ":%n", &addr, &len, &hex);
-			if (len > (unsigned)(size - hex) / 2) {
-				gdb_putpacketz("E02");
-				break;
-			}
-			DEBUG_GDB("M packet: addr = %" PRIx32 ", len = %" PRIx32 "\n",
-					  addr, len);
-			uint8_t mem[len];
-			unhexify(mem, pbuf + hex, len);
-			if (target_mem_write(cur_target, addr, mem, len))
-				gdb_putpacketz("E01");
-			else
-				gdb_putpacketz("OK");
+		}
+	} else {
+		switch (halt_reason) {
+		case TARGET_HALT_ERROR:
+			gdb_putpacket_f("X%02X", GDB_SIGLOST);
 			break;
-			}
-		case 'S':
-			/* fall through */
-		case 's':	/* 's [addr]': Single step [start at addr] */
-			single_step = true;
-			/* fall through */
-		case 'C':
-		/* fall through */
-		case 'c': {	/* 'c [addr]': Continue [at addr] */
-			GDB_LOCK();
-			if(!cur_target) {
-				gdb_putpacketz("X1D");
-				break;
-			}
-			target_halt_resume(cur_target, single_step);
-			run_state = true;
-			SET_RUN_STATE(1);
+		case TARGET_HALT_REQUEST:
+			gdb_putpacket_f("T%02X", GDB_SIGINT);
+			break;
+		case TARGET_HALT_WATCHPOINT:
+			gdb_putpacket_f("T%02Xwatch:%08X;", GDB_SIGTRAP, halt_watch);
+			break;
+		case TARGET_HALT_FAULT:
+			gdb_putpacket_f("T%02X", GDB_SIGSEGV);
+			break;
+		default:
+			gdb_putpacket_f("T%02X", GDB_SIGTRAP);
 			break;
 		}
-		case 0x03: {
+	}
+	run_state = false;
+	single_step = false;
+}
+
+void GDB::halt_poll_task(void *arg)
+{
+	(void)arg;
+	void* tls[2] = {};
+	vTaskSetThreadLocalStoragePointer(0, 0, tls); //used for exception handling
+
+	while (1) {
+		if (!halt_running) {
 			{
-				DEBUG_GDB("Interrupt :%d", pbuf[0]);
 				GDB_LOCK();
-				run_state = true;
-				target_halt_request(cur_target);
+				if (!halt_running && !num_clients) {
+					halt_poll_handle = nullptr;
+					break;
+				}
 			}
-			break;
+			xSemaphoreTake(halt_poll_wake, portMAX_DELAY);
+			continue;
 		}
-		case '?': {	/* '?': Request reason for target halt */
-			/* This packet isn't documented as being mandatory,
-			 * but GDB doesn't work without it. */
-			target_addr_t watch;
-			enum target_halt_reason reason = TARGET_HALT_RUNNING;
-			GDB_LOCK();
+		uint32_t ticks = halt_poll_ms / portTICK_PERIOD_MS;
+		vTaskDelay(ticks ? ticks : 1);
 
-			if(!cur_target) {
-				/* Report "target exited" if no target */
-				gdb_putpacketz("W00");
-				break;
+		GDB_LOCK();
+		GDB *owner = halt_waiters;
+		if (!halt_running || !owner)
+			continue;
+		if (!cur_target) {
+			halt_running = false;
+			continue;
+		}
+		/* Owner is in the middle of a packet, retry on the next tick */
+		if (xSemaphoreTake(owner->io_mutex, 0) != pdTRUE)
+			continue;
+
+		tls[0] = owner;
+		target_addr_t watch = 0;
+		enum target_halt_reason reason = TARGET_HALT_RUNNING;
+		volatile struct exception e;
+		TRY_CATCH (e, EXCEPTION_ALL) {
+			reason = target_halt_poll(cur_target, &watch);
+		}
+		if (e.type)
+			reason = TARGET_HALT_ERROR;
+
+		if (reason == TARGET_HALT_RUNNING) {
+			if (halt_poll_ms < HALT_POLL_MAX_MS)
+				halt_poll_ms *= 2;
+		} else {
+			halt_reason = reason;
+			halt_watch = watch;
+			halt_seq++;
+			halt_running = false;
+			gdb_mem_cache_invalidate();
+
+			/* The stop replies go out from each client's own task,
+			 * see gdb_idle() */
+			while (GDB *c = halt_waiters) {
+				halt_waiters = c->halt_next;
+				c->halt_next = nullptr;
+				c->halt_waiting = false;
 			}
+		}
+		tls[0] = nullptr;
+		xSemaphoreGive(owner->io_mutex);
+	}
+	ESP_LOGI("GDB", "halt_poll exits, %u of %u stack unused",
+		 (unsigned)uxTaskGetStackHighWaterMark(NULL), HALT_POLL_STACK);
+	vTaskDelete(NULL);
+}
 
-			/* Wait for target halt */
-			// while(!(reason) && run_state) {
-				//ESP_LOGI("?", "Wait halt %d", reason);
-				{
-					if(!cur_target) {
-						/* Report "target exited" if no target */
-						gdb_putpacketz("W00");
-						break;
-					}
-					reason = target_halt_poll(cur_target, &watch);
+void GDB::halt_poll_init()
+{
+	halt_poll_wake = xSemaphoreCreateBinary();
+}
+
+/* Watch list sampling: "monitor watch" registers memory the probe reads
+ * on its own timer. Values are pushed to the registering client as
+ * "%Watch:<ms>:<addr>:<hex>" notifications, or as console output while
+ * an all-stop client waits for the target to stop. A sample is skipped
+ * and counted as missed when the client is busy with a packet, still
+ * waiting for the ack of its last reply, or the send fails.
+ */
+#define WATCH_MAX	8
+#define WATCH_SIZE_MAX	32
+/* A target read and one formatted frame */
+#define WATCH_STACK	2048
+
+struct watch_entry {
+	GDB *owner;
+	target_addr_t addr;
+	uint8_t size;
+	TickType_t period;
+	TickType_t next;
+	uint32_t missed;
+};
+
+static watch_entry watches[WATCH_MAX];
+static xSemaphoreHandle watch_wake;
+/* Runs while any entry is registered */
+static xTaskHandle watch_handle;
+
+/* Watch state is protected by the GDB lock */
+void GDB::watch_forget()
+{
+	for (watch_entry &w : watches)
+		if (w.owner == this)
+			w.owner = nullptr;
+}
+
+/* False when the console frame would have to wait for an earlier ack,
+ * notifications are never acked */
+bool GDB::watch_report(uint32_t ms, target_addr_t addr, const uint8_t *data, size_t size)
+{
+	char hex[WATCH_SIZE_MAX * 2 + 1];
+	gdb_hexify(hex, data, size);
+	if (!non_stop && run_state) {
+		if (!gdb_ack_ready())
+			return false;
+		gdb_outf("watch %" PRIu32 " %08" PRIX32 " %s\n", ms, addr, hex);
+	} else {
+		gdb_putnotifpacket_f("Watch:%" PRIu32 ":%08" PRIX32 ":%s", ms, addr, hex);
+	}
+	return true;
+}
+
+bool GDB::watch_command(int argc, const char **argv)
+{
+	GDB_LOCK();
+	if (argc == 2 && !strcmp(argv[1], "clear")) {
+		watch_forget();
+	} else if (argc > 1) {
+		if ((argc - 1) % 3) {
+			gdb_outf("usage: watch [clear | <addr> <size> <period ms> ...]\n");
+			return false;
+		}
+		for (int i = 1; i < argc; i += 3) {
+			uint32_t addr = strtoul(argv[i], NULL, 0);
+			uint32_t size = strtoul(argv[i + 1], NULL, 0);
+			uint32_t ms = strtoul(argv[i + 2], NULL, 0);
+			if (!size || size > WATCH_SIZE_MAX || !ms) {
+				gdb_outf("Size must be 1..%d bytes, period at least 1 ms\n", WATCH_SIZE_MAX);
+				return false;
+			}
+			watch_entry *w = nullptr;
+			for (watch_entry &e : watches)
+				if (!e.owner) {
+					w = &e;
+					break;
 				}
-				// unsigned char c = gdb_if_getchar_to(20);
-				// if((c == '\x03') || (c == '\x04')) {
-					// GDB_LOCK();
-					// ESP_LOGW(__func__, "Interrupt request");
+			if (!w) {
+				gdb_outf("Watch list full (%d entries)\n", WATCH_MAX);
+				return false;
+			}
+			TickType_t period = ms / portTICK_PERIOD_MS;
+			w->owner = this;
+			w->addr = addr;
+			w->size = size;
+			w->period = period ? period : 1;
+			w->next = xTaskGetTickCount();
+			w->missed = 0;
+		}
+		if (!watch_wake)
+			watch_wake = xSemaphoreCreateBinary();
+		if (!watch_handle &&
+		    xTaskCreate(watch_task, "watch", WATCH_STACK, NULL, 2, &watch_handle) != pdPASS) {
+			watch_handle = nullptr;
+			watch_forget();
+			gdb_outf("No memory for the watch task\n");
+			return false;
+		}
+		xSemaphoreGive(watch_wake);
+	}
 
-					// target_halt_request(cur_target);
-				// }
-			// }
-			ESP_LOGW("?", "halted %d", reason);
-			SET_RUN_STATE(0);
-
-			/* Translate reason to GDB signal */
-			switch (reason) {
-			case TARGET_HALT_ERROR:
-				gdb_putpacket_f("X%02X", GDB_SIGLOST);
-				morse("TARGET LOST.", true);
-				break;
-			case TARGET_HALT_REQUEST:
-				gdb_putpacket_f("T%02Xthread:1;core:0;", GDB_SIGINT);
-				break;
-			case TARGET_HALT_WATCHPOINT:
-				gdb_putpacket_f("T%02Xwatch:%08X;", GDB_SIGTRAP, watch);
-				break;
-			case TARGET_HALT_FAULT:
-				gdb_putpacket_f("T%02Xthread:1;core:0;", GDB_SIGSEGV);
-				break;
-			case TARGET_HALT_RUNNING:
-				gdb_putpacket_f("T%02Xthread:1;core:0;", 0);
+	for (watch_entry &w : watches)
+		if (w.owner == this)
+			gdb_outf("%08" PRIX32 " %u bytes every %u ms, %u missed\n", w.addr,
+				w.size, w.period * portTICK_PERIOD_MS, w.missed);
+	return true;
+}
+
+void GDB::watch_task(void *arg)
+{
+	(void)arg;
+	void* tls[2] = {};
+	vTaskSetThreadLocalStoragePointer(0, 0, tls); //used for exception handling
+
+	while (1) {
+		TickType_t wait = portMAX_DELAY;
+		{
+			GDBLock lock(GDB_LOCK_READ);
+			/* Cleared or every owner has left */
+			bool active = false;
+			for (watch_entry &w : watches)
+				active |= w.owner != nullptr;
+			if (!active) {
+				watch_handle = nullptr;
 				break;
-			default:
-				gdb_putpacket_f("T%02Xthread:1;core:0;", GDB_SIGTRAP);
 			}
-			break;
+			TickType_t now = xTaskGetTickCount();
+			for (watch_entry &w : watches) {
+				if (!w.owner)
+					continue;
+				if ((int32_t)(w.next - now) <= 0) {
+					w.next += w.period;
+					/* Fell behind, don't try to catch up */
+					if ((int32_t)(w.next - now) <= 0)
+						w.next = now + w.period;
+
+					GDB *c = w.owner;
+					if (!cur_target || xSemaphoreTake(c->io_mutex, 0) != pdTRUE) {
+						w.missed++;
+					} else {
+						uint8_t data[WATCH_SIZE_MAX];
+						uint32_t ms = platform_time_ms();
+						bool ok = false;
+						tls[0] = c;
+						volatile struct exception e;
+						/* Never wait for an ack on a borrowed connection,
+						 * and a closed one must unwind to here */
+						TRY_CATCH (e, EXCEPTION_ALL) {
+							ok = !target_mem_read(cur_target, data, w.addr, w.size) &&
+								c->watch_report(ms, w.addr, data, w.size) &&
+								!c->io_failed;
+						}
+						if (!ok || e.type)
+							w.missed++;
+						tls[0] = nullptr;
+						xSemaphoreGive(c->io_mutex);
+					}
+				}
+				if (w.next - now < wait)
+					wait = w.next - now;
 			}
+		}
+		xSemaphoreTake(watch_wake, wait);
+	}
+	ESP_LOGI("GDB", "watch exits, %u of %u stack unused",
+		 (unsigned)uxTaskGetStackHighWaterMark(NULL), WATCH_STACK);
+	vTaskDelete(NULL);
+}
 
-		/* Optional GDB packet support */
-		case 'p': { /* Read single register */
-			ERROR_IF_NO_TARGET();
-			uint32_t reg;
-			sscanf(pbuf, "p%" SCNx32, &reg);
-			uint8_t val[8];
-			size_t s = target_reg_read(cur_target, reg, val, sizeof(val));
-			if (s > 0) {
-				gdb_putpacket(hexify(pbuf, val, s), s * 2);
-			} else {
-				gdb_putpacketz("EFF");
+void GDB::gdb_session_start()
+{
+	GDB_LOCK();
+    ESP_LOGI(__func__, "cur_target=%p last_target=%p\n", cur_target, last_target);
+#ifdef CONFIG_GDB_TARGET_CACHE
+	if(num_clients == 1 && gdb_target_cached(cur_target ? cur_target : last_target)) {
+		volatile struct exception e;
+		TRY_CATCH (e, EXCEPTION_ALL) {
+			if(!cur_target)
+				cur_target = target_attach(last_target, &gdb_controller);
+		}
+		if(cur_target && !e.type) {
+			ESP_LOGI("GDB", "Reusing %s from the last scan", target_driver_name(cur_target));
+			return;
+		}
+	}
+#endif
+	if((!cur_target && !last_target) || num_clients == 1) {
+		ESP_LOGI("GDB", "Scanning SWD");
+		int devs = -1;
+		volatile struct exception e;
+		TRY_CATCH (e, EXCEPTION_ALL) {
+			devs = adiv5_swdp_scan(0);
+			ESP_LOGI("GDB", "Found %d", devs);
+			if(devs > 0) {
+				cur_target = target_attach_n(1, &gdb_controller);
+				gdb_attach_hooks(cur_target);
+				if(cur_target) {
+					gdb_swd_tune(cur_target);
+					static const command_s cmds[]  = { 
+						{"reset", cmd_reset, "OpenOCD style target reset: reset [init halt run]"}, 
+						{"watch", cmd_watch, "Sample memory on the probe: watch [clear | <addr> <size> <period ms> ...]"},
+						{"packetsize", cmd_packetsize, "GDB packet size for new connections: packetsize [bytes]"},
+						{"rle", cmd_rle, "Run-length encoding of replies to this client: rle [enable|disable]"},
+						{"lockstats", cmd_lockstats, "Target lock statistics: lockstats [reset]"},
+						{"incremental", gdb_flash_inc_command, "Skip flash sectors that already match: incremental [enable|disable]"},
+						{"autotune", gdb_swd_tune_command, "Tune and save the SWD clock for this target: autotune [clear]"},
+#ifdef CONFIG_GDB_READ_CACHE
+						{"readcache", gdb_mem_cache_command, "Memory read cache: readcache [enable|disable]"},
+#endif
+						{"WriteDP", cmd_write_dp, "STLINK helper"},
+						{"ReadAP", cmd_read_ap, "STLINK helper"},
+
+						{0,0,0} 
+					};
+					target_add_commands(cur_target, cmds, "Target");
+				}
 			}
+		}
+		switch (e.type) {
+		case EXCEPTION_TIMEOUT:
+			ESP_LOGI("GDB", "Timeout during scan. Is target stuck in WFI?\n");
 			break;
-			}
-		case 'P': { /* Write single register */
-			ERROR_IF_NO_TARGET();
-			uint32_t reg;
-			int n;
-			sscanf(pbuf, "P%" SCNx32 "=%n", &reg, &n);
-			uint8_t val[strlen(&pbuf[n])/2];
-			unhexify(val, pbuf + n, sizeof(val));
-			if (target_reg_write(cur_target, reg, val, sizeof(val)) > 0) {
-				gdb_putpacketz("OK");
-			} else {
-				gdb_putpacketz("EFF");
-			}
+		case EXCEPTION_ERROR:
+			ESP_LOGI("GDB", "Exception: %s\n", e.msg);
 			break;
-			}
+		}
+	}
+}
 
-		case 'F':	/* Semihosting call finished */
-			if (in_syscall) {
-				return hostio_reply(tc, pbuf, size);
-			} else {
-				DEBUG_GDB("*** F packet when not in syscall! '%s'\n", pbuf);
-				gdb_putpacketz("");
-			}
-			break;
+/* Handles one received packet. Returns true when the caller should
+ * leave its loop with *ret, which happens for the F reply to a syscall.
+ */
+static gdb_lock_class gdb_packet_class(const char *packet)
+{
+	switch(packet[0]) {
+	case 'm': case 'x': case 'g': case 'p':
+		return GDB_LOCK_READ;
+	case 'M': case 'X': case 'G': case 'P':
+		return GDB_LOCK_FLASH;
+	case 'q':
+		return strncmp(packet, "qRcmd,", 6) ? GDB_LOCK_READ : GDB_LOCK_RUN;
+	case 'v':
+		return strncmp(packet, "vFlash", 6) ? GDB_LOCK_RUN : GDB_LOCK_FLASH;
+	default:
+		return GDB_LOCK_RUN;
+	}
+}
 
-		case '!':	/* Enable Extended GDB Protocol. */
-			/* This doesn't do anything, we support the extended
-			 * protocol anyway, but GDB will never send us a 'R'
-			 * packet unless we answer 'OK' here.
-			 */
-			gdb_putpacketz("OK");
+bool GDB::gdb_handle_packet(struct target_controller *tc, bool in_syscall, int size, int *ret)
+{
+	/* Queued flash writes land before anything else touches the target */
+	if (strncmp(pbuf, "vFlashWrite", 11))
+		gdb_flash_pipe_wait();
+
+	lock_class = gdb_packet_class(pbuf);
+	if (lock_class == GDB_LOCK_READ)
+		gdb_read_throttle();
+
+	/* Anything but a plain query may change target memory */
+	switch(pbuf[0]) {
+	case 'm': case 'x': case 'g': case 'p': case '?': case 'T': case 'H':
+		break;
+	case 'q':
+		if (strncmp(pbuf, "qRcmd,", 6))
 			break;
+		/* fall through */
+	default:
+		gdb_mem_cache_invalidate();
+	}
 
-		case 0x04:
-		case 'D': {	/* GDB 'detach' command. */
-			GDB_LOCK();
-			if(cur_target) {
-				SET_RUN_STATE(1);
-				target_detach(cur_target);
-			}
-			last_target = cur_target;
-			cur_target = NULL;
-			gdb_putpacketz("OK");
+	switch(pbuf[0]) {
+	/* Implementation of these is mandatory! */
+	case 'g': { /* 'g': Read general registers */
+		ERROR_IF_NO_TARGET();
+		uint8_t gp_regs[target_regs_size(cur_target)];
+		target_regs_read(cur_target, gp_regs);
+		gdb_putpacket(gdb_hexify(pbuf, gp_regs, sizeof(gp_regs)), sizeof(gp_regs) * 2U);
+		break;
+		}
+	case 'T': //thread select
+		gdb_putpacketz("OK");
+		break;
+	case 'm': {	/* 'm addr,len': Read len bytes from addr */
+		uint32_t addr, len;
+		ERROR_IF_NO_TARGET();
+		if (!gdb_hex_addr_len(pbuf + 1, &addr, &len)) {
+			gdb_putpacketz("E01");
 			break;
 		}
-		case 'k': {	/* Kill the target */
-			GDB_LOCK();
-			if(cur_target) {
-				target_reset(cur_target);
-				target_detach(cur_target);
-				last_target = cur_target;
-				cur_target = NULL;
-			}
+		if (len > (pbuf_size - 1) / 2) {
+			gdb_putpacketz("E02");
+			break;
+		}
+		DEBUG_GDB("m packet: addr = %" PRIx32 ", len = %" PRIx32 "\n",
+				  addr, len);
+		/* Read into the upper half and hexify in place, the hex
+		 * output never overtakes the bytes still to be converted */
+		uint8_t *mem = (uint8_t *)pbuf + len;
+		if (gdb_mem_cache_read(cur_target, mem, addr, len)) {
+			DEBUG_WARN("target_mem_read error");
+			gdb_putpacketz("E01");
+		} else
+			gdb_putpacket(gdb_hexify(pbuf, mem, len), len*2);
+		break;
+		}
+	case 'x': {	/* 'x addr,len': Read len bytes from addr, binary reply */
+		uint32_t addr, len;
+		ERROR_IF_NO_TARGET();
+		if (!gdb_hex_addr_len(pbuf + 1, &addr, &len)) {
+			gdb_putpacketz("E01");
 			break;
 		}
-		case 'r':	/* Reset the target system */
-		case 'R':	/* Restart the target program */
+		if (len > pbuf_size - 2) {
+			gdb_putpacketz("E02");
+			break;
+		}
+		DEBUG_GDB("x packet: addr = %" PRIx32 ", len = %" PRIx32 "\n",
+				  addr, len);
+		/* Escaping is left to the packet layer */
+		pbuf[0] = 'b';
+		if (gdb_mem_cache_read(cur_target, pbuf + 1, addr, len)) {
+			DEBUG_WARN("target_mem_read error");
+			gdb_putpacketz("E01");
+		} else
+			gdb_putpacket(pbuf, len + 1);
+		break;
+		}
+	case 'G': {	/* 'G XX': Write general registers */
+		ERROR_IF_NO_TARGET();
+		uint8_t arm_regs[target_regs_size(cur_target)];
+		gdb_unhexify(arm_regs, &pbuf[1], sizeof(arm_regs));
+		target_regs_write(cur_target, arm_regs);
+		gdb_putpacketz("OK");
+		break;
+		}
+	case 'H': //select thread: Hc0, Hg-1
+		gdb_putpacketz("OK");
+		break;
+	case 'M': { /* 'M addr,len:XX': Write len bytes to addr */
+		uint32_t addr, len;
+		ERROR_IF_NO_TARGET();
+		const char *arg = gdb_hex_addr_len(pbuf + 1, &addr, &len);
+		if (!arg || *arg++ != ':') {
+			gdb_putpacketz("E01");
+			break;
+		}
+		int hex = arg - pbuf;
+		if (len > (unsigned)(size - hex) / 2) {
+			gdb_putpacketz("E02");
+			break;
+		}
+		DEBUG_GDB("M packet: addr = %" PRIx32 ", len = %" PRIx32 "\n",
+				  addr, len);
+		/* Decoding in place is safe, output trails the hex input */
+		uint8_t *mem = (uint8_t *)pbuf;
+		gdb_unhexify(mem, pbuf + hex, len);
+		if (target_mem_write(cur_target, addr, mem, len))
+			gdb_putpacketz("E01");
+		else
+			gdb_putpacketz("OK");
+		break;
+		}
+	case 'S':
+		/* fall through */
+	case 's':	/* 's [addr]': Single step [start at addr] */
+		single_step = true;
+		/* fall through */
+	case 'C':
+	/* fall through */
+	case 'c': {	/* 'c [addr]': Continue [at addr] */
+		GDB_LOCK();
+		if(!cur_target) {
+			gdb_putpacketz("X1D");
+			break;
+		}
+		target_halt_resume(cur_target, single_step);
+		run_state = true;
+		halt_poll_start();
+		SET_RUN_STATE(1);
+		break;
+	}
+	case 0x03: {
 		{
+			DEBUG_GDB("Interrupt :%d", pbuf[0]);
 			GDB_LOCK();
-			if(cur_target)
-				target_reset(cur_target);
-			else if(last_target) {
-				cur_target = target_attach(last_target,
-						           &gdb_controller);
-				target_reset(cur_target);
-			}
+			run_state = true;
+			target_halt_request(cur_target);
+			halt_poll_start();
 		}
-			break;
+		break;
+	}
+	case '?': {	/* '?': Request reason for target halt */
+		/* This packet isn't documented as being mandatory,
+		 * but GDB doesn't work without it. */
+		target_addr_t watch;
+		enum target_halt_reason reason = TARGET_HALT_RUNNING;
+		GDB_LOCK();
 
-		case 'X': { /* 'X addr,len:XX': Write binary data to addr */
-			uint32_t addr, len;
-			int bin;
-			ERROR_IF_NO_TARGET();
-			sscanf(pbuf, "X%" SCNx32 ",%" SCNx32 ":%n", &addr, &len, &bin);
-			if (len > (unsigned)(size - bin)) {
-				gdb_putpacketz("E02");
-				break;
-			}
-			DEBUG_GDB("X packet: addr = %" PRIx32 ", len = %" PRIx32 "\n",
-					  addr, len);
-		    uint8_t alignas(4) data[len] ;
-		    memcpy(data, pbuf+bin, len);
-			if (target_mem_write(cur_target, addr, data, len))
-				gdb_putpacketz("E01");
-			else
-				gdb_putpacketz("OK");
+		if(!cur_target) {
+			/* Report "target exited" if no target */
+			gdb_putpacketz("W00");
 			break;
+		}
+
+		/* Wait for target halt */
+		// while(!(reason) && run_state) {
+			//ESP_LOGI("?", "Wait halt %d", reason);
+			{
+				if(!cur_target) {
+					/* Report "target exited" if no target */
+					gdb_putpacketz("W00");
+					break;
+				}
+				reason = target_halt_poll(cur_target, &watch);
 			}
+			// unsigned char c = gdb_if_getchar_to(20);
+			// if((c == '\x03') || (c == '\x04')) {
+				// GDB_LOCK();
+				// ESP_LOGW(__func__, "Interrupt request");
 
-		case 'q':	/* General query packet */
-			handle_q_packet(pbuf, size);
+				// target_halt_request(cur_target);
+			// }
+		// }
+		ESP_LOGW("?", "halted %d", reason);
+		SET_RUN_STATE(0);
+
+		/* Translate reason to GDB signal */
+		switch (reason) {
+		case TARGET_HALT_ERROR:
+			gdb_putpacket_f("X%02X", GDB_SIGLOST);
+			morse("TARGET LOST.", true);
 			break;
+		case TARGET_HALT_REQUEST:
+			gdb_putpacket_f("T%02Xthread:1;core:0;", GDB_SIGINT);
+			break;
+		case TARGET_HALT_WATCHPOINT:
+			gdb_putpacket_f("T%02Xwatch:%08X;", GDB_SIGTRAP, watch);
+			break;
+		case TARGET_HALT_FAULT:
+			gdb_putpacket_f("T%02Xthread:1;core:0;", GDB_SIGSEGV);
+			break;
+		case TARGET_HALT_RUNNING:
+			gdb_putpacket_f("T%02Xthread:1;core:0;", 0);
+			break;
+		default:
+			gdb_putpacket_f("T%02Xthread:1;core:0;", GDB_SIGTRAP);
+		}
+		break;
+		}
 
-		case 'v':	/* General query packet */
-			handle_v_packet(pbuf, size);
+	/* Optional GDB packet support */
+	case 'p': { /* Read single register */
+		ERROR_IF_NO_TARGET();
+		const char *arg = pbuf + 1;
+		uint32_t reg = gdb_hex_parse(&arg);
+		uint8_t val[8];
+		size_t s = target_reg_read(cur_target, reg, val, sizeof(val));
+		if (s > 0) {
+			gdb_putpacket(gdb_hexify(pbuf, val, s), s * 2);
+		} else {
+			gdb_putpacketz("EFF");
+		}
+		break;
+		}
+	case 'P': { /* Write single register */
+		ERROR_IF_NO_TARGET();
+		const char *arg = pbuf + 1;
+		uint32_t reg = gdb_hex_parse(&arg);
+		if (*arg++ != '=') {
+			gdb_putpacketz("E01");
 			break;
+		}
+		int n = arg - pbuf;
+		uint8_t val[strlen(&pbuf[n])/2];
+		gdb_unhexify(val, pbuf + n, sizeof(val));
+		if (target_reg_write(cur_target, reg, val, sizeof(val)) > 0) {
+			gdb_putpacketz("OK");
+		} else {
+			gdb_putpacketz("EFF");
+		}
+		break;
+		}
 
-		/* These packet implement hardware break-/watchpoints */
-		case 'Z':	/* Z type,addr,len: Set breakpoint packet */
-		case 'z': {	/* z type,addr,len: Clear breakpoint packet */
-			ERROR_IF_NO_TARGET();
-			handle_z_packet(pbuf, size);
+	case 'F':	/* Semihosting call finished */
+		if (in_syscall) {
+			*ret = hostio_reply(tc, pbuf, size);
+			return true;
+		} else {
+			DEBUG_GDB("*** F packet when not in syscall! '%s'\n", pbuf);
+			gdb_putpacketz("");
+		}
+		break;
+
+	case '!':	/* Enable Extended GDB Protocol. */
+		/* This doesn't do anything, we support the extended
+		 * protocol anyway, but GDB will never send us a 'R'
+		 * packet unless we answer 'OK' here.
+		 */
+		gdb_putpacketz("OK");
+		break;
+
+	case 0x04:
+	case 'D': {	/* GDB 'detach' command. */
+		GDB_LOCK();
+		if(cur_target) {
+			SET_RUN_STATE(1);
+			target_detach(cur_target);
+		}
+		last_target = cur_target;
+		cur_target = NULL;
+		gdb_putpacketz("OK");
+		break;
+	}
+	case 'k': {	/* Kill the target */
+		GDB_LOCK();
+		if(cur_target) {
+			target_reset(cur_target);
+			target_detach(cur_target);
+			last_target = cur_target;
+			cur_target = NULL;
+		}
+		break;
+	}
+	case 'r':	/* Reset the target system */
+	case 'R':	/* Restart the target program */
+	{
+		GDB_LOCK();
+		if(cur_target)
+			target_reset(cur_target);
+		else if(last_target) {
+			cur_target = target_attach(last_target,
+					           &gdb_controller);
+			target_reset(cur_target);
+		}
+	}
+		break;
+
+	case 'X': { /* 'X addr,len:XX': Write binary data to addr */
+		uint32_t addr, len;
+		ERROR_IF_NO_TARGET();
+		const char *arg = gdb_hex_addr_len(pbuf + 1, &addr, &len);
+		if (!arg || *arg++ != ':') {
+			gdb_putpacketz("E01");
 			break;
 		}
-		default: 	{
-			int val;
-			if (!strcmp(pbuf, "QStartNoAckMode")) {
-				no_ack_mode = true;
-				gdb_putpacketz("OK");
-			} else if (sscanf(pbuf, "QNonStop:%d", &val) == 1) {
-				non_stop = val;
-				gdb_putpacketz("OK");
-			} else {
-				DEBUG_GDB("*** Unsupported packet: %s\n", pbuf);
-				gdb_putpacketz("");
-			}
+		int bin = arg - pbuf;
+		if (len > (unsigned)(size - bin)) {
+			gdb_putpacketz("E02");
+			break;
+		}
+		DEBUG_GDB("X packet: addr = %" PRIx32 ", len = %" PRIx32 "\n",
+				  addr, len);
+		/* Move the payload to the (word aligned) start of the buffer */
+		uint8_t *data = (uint8_t *)memmove(pbuf, pbuf + bin, len);
+		if (target_mem_write(cur_target, addr, data, len))
+			gdb_putpacketz("E01");
+		else
+			gdb_putpacketz("OK");
+		break;
 		}
+
+	case 'q':	/* General query packet */
+		handle_q_packet(pbuf, size);
+		break;
+
+	case 'v':	/* General query packet */
+		handle_v_packet(pbuf, size);
+		break;
+
+	/* These packet implement hardware break-/watchpoints */
+	case 'Z':	/* Z type,addr,len: Set breakpoint packet */
+	case 'z': {	/* z type,addr,len: Clear breakpoint packet */
+		ERROR_IF_NO_TARGET();
+		handle_z_packet(pbuf, size);
+		break;
+	}
+	default: 	{
+		if (!strcmp(pbuf, "QStartNoAckMode")) {
+			no_ack_mode = true;
+			gdb_putpacketz("OK");
+		} else if (!strncmp(pbuf, "QNonStop:", 9) && isdigit((unsigned char)pbuf[9])) {
+			non_stop = pbuf[9] != '0';
+			gdb_putpacketz("OK");
+		} else {
+			DEBUG_GDB("*** Unsupported packet: %s\n", pbuf);
+			gdb_putpacketz("");
 		}
 	}
+	}
+	return false;
+}
+
+/* Reads are rate limited only while other clients share the target, and
+ * not in single task mode where a delay would stall every connection */
+void GDB::gdb_read_throttle()
+{
+#if CONFIG_GDB_READ_RATE > 0 && !defined(CONFIG_GDB_SINGLE_TASK)
+	const uint32_t cost = configTICK_RATE_HZ;
+	const uint32_t burst = CONFIG_GDB_READ_BURST * cost;
+	TickType_t now = xTaskGetTickCount();
+
+	read_credit += (now - read_refill) * CONFIG_GDB_READ_RATE;
+	if (read_credit > burst || now - read_refill > configTICK_RATE_HZ)
+		read_credit = burst;
+	read_refill = now;
+
+	if (num_clients > 1 && read_credit < cost) {
+		TickType_t wait = (cost - read_credit + CONFIG_GDB_READ_RATE - 1) / CONFIG_GDB_READ_RATE;
+		gdb_lock_throttled();
+		vTaskDelay(wait);
+		read_credit += wait * CONFIG_GDB_READ_RATE;
+		read_refill += wait;
+	}
+	if (read_credit >= cost)
+		read_credit -= cost;
+#endif
+}
+
+void GDB::gdb_idle()
+{
+	lock_class = GDB_LOCK_RUN;
+	if(run_state) {
+		/* Halts found while we were busy are reported here */
+		GDB_LOCK();
+		gdb_halt_report();
+	}
+}
+
+void GDB::gdb_main_packet(int size)
+{
+	int ret;
+	gdb_handle_packet(&gdb_controller, false, size, &ret);
+}
+
+int GDB::gdb_main_loop(struct target_controller *tc, bool in_syscall)
+{
+	int size, ret;
+
+	gdb_session_start();
+
+	/* GDB protocol main loop */
+	while(1) {
+		SET_IDLE_STATE(1);
+		gdb_pbuf_release();
+		size = gdb_getpacket();
+		if(size == 0) {
+			gdb_idle();
+			continue;
+		} 
+		SET_IDLE_STATE(0);
+		if (gdb_handle_packet(tc, in_syscall, size, &ret))
+			return ret;
+	}
+}
+
+/* Dispatch tables for q and v packets, looked up by binary search on the
+ * packet prefix. Keep them sorted and prefix free; exact entries compare
+ * the terminating NUL as well.
+ */
+struct gdb_packet_entry {
+	const char *name;
+	uint8_t len;
+	uint8_t id;
+};
+
+#define PKT_PREFIX(name, id)	{ name, sizeof(name) - 1, id }
+#define PKT_EXACT(name, id)	{ name, sizeof(name), id }
+
+enum { Q_ATTACHED, Q_C, Q_CRC, Q_RCMD, Q_SUPPORTED, Q_XFER_FEATURES,
+       Q_XFER_MEMORY_MAP, Q_THREAD_INFO };
+
+static const gdb_packet_entry q_packets[] = {
+	PKT_PREFIX("qAttached", Q_ATTACHED),
+	PKT_EXACT("qC", Q_C),
+	PKT_PREFIX("qCRC:", Q_CRC),
+	PKT_PREFIX("qRcmd,", Q_RCMD),
+	PKT_PREFIX("qSupported", Q_SUPPORTED),
+	PKT_PREFIX("qXfer:features:read:target.xml:", Q_XFER_FEATURES),
+	PKT_PREFIX("qXfer:memory-map:read::", Q_XFER_MEMORY_MAP),
+	PKT_EXACT("qfThreadInfo", Q_THREAD_INFO),
+	PKT_EXACT("qsThreadInfo", Q_THREAD_INFO),
+};
+
+enum { V_ATTACH, V_CONT, V_FLASH_DONE, V_FLASH_ERASE, V_FLASH_WRITE,
+       V_KILL, V_RUN, V_STOPPED };
+
+static const gdb_packet_entry v_packets[] = {
+	PKT_PREFIX("vAttach;", V_ATTACH),
+	PKT_PREFIX("vCont", V_CONT),
+	PKT_EXACT("vFlashDone", V_FLASH_DONE),
+	PKT_PREFIX("vFlashErase:", V_FLASH_ERASE),
+	PKT_PREFIX("vFlashWrite:", V_FLASH_WRITE),
+	PKT_PREFIX("vKill;", V_KILL),
+	PKT_PREFIX("vRun", V_RUN),
+	PKT_EXACT("vStopped", V_STOPPED),
+};
+
+static int gdb_packet_lookup(const gdb_packet_entry *table, size_t n, const char *packet)
+{
+	size_t lo = 0, hi = n;
+
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		int c = strncmp(table[mid].name, packet, table[mid].len);
+		if (c == 0)
+			return table[mid].id;
+		if (c < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return -1;
 }
 
 void
 GDB::handle_q_string_reply(const char *str, const char *param)
 {
-	unsigned long addr, len;
+	const char *p = param;
+	uint32_t addr, len;
 
-	if (sscanf(param, "%08lx,%08lx", &addr, &len) != 2) {
+	addr = gdb_hex_parse(&p);
+	if (p == param || *p++ != ',' || !isxdigit((unsigned char)*p)) {
 		gdb_putpacketz("E01");
 		return;
 	}
+	len = gdb_hex_parse(&p);
 	if (addr < strlen (str)) {
 		char reply[len+2];
 		reply[0] = 'm';
@@ -576,7 +1179,8 @@ GDB::handle_q_packet(char *packet, int len)
 {
 	uint32_t addr, alen;
 
-	if(!strncmp(packet, "qRcmd,", 6)) {
+	switch (gdb_packet_lookup(q_packets, sizeof(q_packets) / sizeof(q_packets[0]), packet)) {
+	case Q_RCMD: {
 		char *data;
 		int datalen;
 		GDB_LOCK();
@@ -584,7 +1188,7 @@ GDB::handle_q_packet(char *packet, int len)
 		datalen = (len - 6) / 2;
 		data = (char*)alloca(datalen+1);
 		/* dehexify command */
-		unhexify(data, packet+6, datalen);
+		gdb_unhexify(data, packet+6, datalen);
 		data[datalen] = 0;	/* add terminating null */
 		ESP_LOGI("CMD", "%s", data);
 
@@ -610,16 +1214,22 @@ GDB::handle_q_packet(char *packet, int len)
 		else if(c == 255) {}
 		else
 			gdb_putpacketz("E");
-
-	} else if (!strncmp (packet, "qSupported", 10)) {
-		/* Query supported protocol features */
-		gdb_putpacket_f("PacketSize=%X;qXfer:memory-map:read+;qXfer:features:read+;QNonStop+;QStartNoAckMode+"/*;qXfer:threads:read+"*/, BUF_SIZE);
-	// } else if (strncmp (packet, "qXfer:threads:read::", 20) == 0) {
-	// 	gdb_putpacket_f("l<?xml version=\"1.0\"?><threads><thread id=\"1\" core=\"0\" name=\"main\"></thread></threads>");
-	} else if (strncmp (packet, "qAttached", 9) == 0) {
+		break;
+	}
+	case Q_SUPPORTED: {
+		/* Query supported protocol features. The size offered here is
+		 * the one this connection keeps. */
+		gdb_packet_size_adopt();
+		gdb_putpacket_f("PacketSize=%X;qXfer:memory-map:read+;qXfer:features:read+;QNonStop+;QStartNoAckMode+;binary-upload+"/*;qXfer:threads:read+"*/, (unsigned)pkt_size);
+		// qXfer:threads:read::
+		// gdb_putpacket_f("l<?xml version=\"1.0\"?><threads><thread id=\"1\" core=\"0\" name=\"main\"></thread></threads>");
+		break;
+	}
+	case Q_ATTACHED: {
 		gdb_putpacket_f("%d", !!cur_target);
-
-	} else if (strncmp (packet, "qXfer:memory-map:read::", 23) == 0) {
+		break;
+	}
+	case Q_XFER_MEMORY_MAP: {
 		GDB_LOCK();
 		/* Read target XML memory map */
 		if((!cur_target) && last_target) {
@@ -640,8 +1250,9 @@ GDB::handle_q_packet(char *packet, int len)
 		handle_q_string_reply(buf, packet + 23);
 
 		free(buf);
-
-	} else if (strncmp (packet, "qXfer:features:read:target.xml:", 31) == 0) {
+		break;
+	}
+	case Q_XFER_FEATURES: {
 		GDB_LOCK();
 		/* Read target description */
 		if((!cur_target) && last_target) {
@@ -657,28 +1268,46 @@ GDB::handle_q_packet(char *packet, int len)
 		const char *const description = target_regs_description(cur_target);
 	    handle_q_string_reply(description ? description : "", packet + 31);
 	    free((void *)description);
-		
-	} else if (sscanf(packet, "qCRC:%" PRIx32 ",%" PRIx32, &addr, &alen) == 2) {
+		break;
+	}
+	case Q_CRC: {
+		const char *p = packet + 5;
+		addr = gdb_hex_parse(&p);
+		if (*p++ != ',') {
+			gdb_putpacketz("E01");
+			return;
+		}
+		alen = gdb_hex_parse(&p);
 		GDB_LOCK();
 		if(!cur_target) {
 			gdb_putpacketz("E01");
 			return;
 		}
 		uint32_t crc;
-		if (!generic_crc32(cur_target, &crc, addr, alen))
+		bool done = false;
+#ifdef CONFIG_GDB_CRC_STUB
+		/* The stub needs the core to itself, so only while it's halted */
+		if (!halt_running)
+			done = gdb_target_crc32_stub(cur_target, &crc, addr, alen);
+#endif
+		if (!done && !gdb_target_crc32(cur_target, &crc, addr, alen))
 			gdb_putpacketz("E03");
-		else
-			gdb_putpacket_f("C%lx", crc);
-
-	} else if (strcmp(packet, "qC") == 0) {
+		else {
+			char reply[10];
+			reply[0] = 'C';
+			gdb_putpacket(reply, gdb_hex_u32(reply + 1, crc) + 1);
+		}
+		break;
+	}
+	case Q_C: {
 		/*
  * qC queries are for the current thread. We don't support threads but GDB 11 and 12 require this,
  * so we always answer that the current thread is thread 1.
  */
 		gdb_putpacketz("QC1");
-
-
-	} else if (strcmp(packet, "qfThreadInfo") == 0 || strcmp(packet, "qsThreadInfo") == 0) {
+		break;
+	}
+	case Q_THREAD_INFO: {
 		/*
 		* qfThreadInfo queries are required in GDB 11 and 12 as these GDBs require the server to support
 		* threading even when there's only the possiblity for one thread to exist. In this instance,
@@ -690,30 +1319,62 @@ GDB::handle_q_packet(char *packet, int len)
 			gdb_putpacketz("m1");
 		else
 			gdb_putpacketz("l");
-
-	} else {
+		break;
+	}
+	default:
 		DEBUG_GDB("*** Unsupported packet: %s\n", packet);
 		gdb_putpacket("", 0);
 	}
 }
 
+/* Called with the target lock held. A client whose load failed has
+ * flash_mode cleared and gives way to the next one. */
+bool GDB::flash_claim()
+{
+	if(flash_owner && flash_owner != this && flash_owner->flash_mode)
+		return false;
+	flash_owner = this;
+	return true;
+}
+
+/* On disconnect, without the target lock: queued writes are finished by
+ * the pipeline task, which takes it */
+void GDB::flash_forget()
+{
+	if(flash_owner != this)
+		return;
+	gdb_flash_pipe_done();
+	GDB_LOCK();
+	gdb_flash_inc_abort();
+	flash_mode = 0;
+	flash_owner = nullptr;
+}
+
 void
 GDB::handle_v_packet(char *packet, int plen)
 {
-	unsigned long addr, len;
-	int bin;
-	static uint8_t flash_mode = 0;
+	uint32_t addr, len;
+	const char *arg;
 
-	if (sscanf(packet, "vAttach;%08lx", &addr) == 1) {
+	switch (gdb_packet_lookup(v_packets, sizeof(v_packets) / sizeof(v_packets[0]), packet)) {
+	case V_ATTACH: {
 		/* Attach to remote target processor */
+		arg = packet + 8;
+		addr = gdb_hex_parse(&arg);
+		if (arg == packet + 8) {
+			gdb_putpacketz("E01");
+			return;
+		}
 		GDB_LOCK();
 		cur_target = target_attach_n(addr, &gdb_controller);
+		gdb_attach_hooks(cur_target);
 		if(cur_target)
 			gdb_putpacketz("T05thread:1;");
 		else
 			gdb_putpacketz("E01");
-
-	} else if (!strncmp(packet, "vRun", 4)) {
+		break;
+	}
+	case V_RUN: {
 		/* Parse command line for get_cmdline semihosting call */
 		char cmdline[83];
 		char *pbuf = cmdline;
@@ -729,7 +1390,7 @@ GDB::handle_v_packet(char *packet, int plen)
 				continue;
 			}
 			if (isxdigit(*tok) && isxdigit(*(tok+1))) {
-				unhexify(pbuf, tok, 2);
+				gdb_unhexify(pbuf, tok, 2);
 				if ((*pbuf == ' ') || (*pbuf == '\\')) {
 					*(pbuf+1)=*pbuf;
 					*pbuf++='\\';
@@ -761,20 +1422,30 @@ GDB::handle_v_packet(char *packet, int plen)
                         } else	gdb_putpacketz("E01");
 
 		} else	gdb_putpacketz("E01");
-
-	} else if (sscanf(packet, "vFlashErase:%08lx,%08lx", &addr, &len) == 2) {
+		break;
+	}
+	case V_FLASH_ERASE: {
+		if (!gdb_hex_addr_len(packet + 12, &addr, &len)) {
+			gdb_putpacketz("EFF");
+			return;
+		}
 		GDB_LOCK();
 		/* Erase Flash Memory */
-		DEBUG_GDB("Flash Erase %08lX len:%d\n", addr, len);
-		if(!cur_target) { gdb_putpacketz("EFF"); return; }
+		DEBUG_GDB("Flash Erase %08" PRIX32 " len:%" PRIu32 "\n", addr, len);
+		if(!cur_target || !flash_claim()) { gdb_putpacketz("EFF"); return; }
 		if(!flash_mode) {
+			/* Queued writes landed before this packet, only a failure
+			 * latched by an abandoned load is dropped here */
+			gdb_flash_pipe_done();
 			/* Reset target if first flash command! */
 			/* This saves us if we're interrupted in IRQ context */
 			target_reset(cur_target);
 			target_halt_request(cur_target);
 			flash_mode = 1;
+			gdb_flash_inc_begin();
 		}
-		if(target_flash_erase(cur_target, addr, len)) {
+		if(gdb_flash_inc_enabled() ? gdb_flash_inc_erase(cur_target, addr, len) :
+		   target_flash_erase(cur_target, addr, len)) {
 			gdb_putpacketz("OK");
 		} else {
 			DEBUG_GDB("Flash Erase Failed\n");
@@ -782,21 +1453,49 @@ GDB::handle_v_packet(char *packet, int plen)
 			flash_mode = 0;
 			gdb_putpacketz("EFF");
 		}
-
-	} else if (sscanf(packet, "vFlashWrite:%08lx:%n", &addr, &bin) == 1) {
+		break;
+	}
+	case V_FLASH_WRITE: {
 		/* Write Flash Memory */
-		//DEBUG_GDB("plen: %d(%x) %d", plen, plen, bin);
-		GDB_LOCK();
+		arg = packet + 12;
+		addr = gdb_hex_parse(&arg);
+		if (*arg++ != ':') {
+			gdb_putpacketz("EFF");
+			return;
+		}
+		int bin = arg - packet;
 		len = plen - bin;
-		DEBUG_GDB("Flash Write %08lX len:%d\n", addr, len);
+		DEBUG_GDB("Flash Write %08" PRIX32 " len:%" PRIu32 "\n", addr, len);
 		//ESP_LOG_BUFFER_HEXDUMP("Flash", packet+bin, len, 3);
-		if(cur_target && target_flash_write(cur_target, addr, (void*)(packet + bin), len)) {
+#ifdef CONFIG_GDB_FLASH_PIPELINE
+		/* Acknowledged once queued, the lock is left to the programming task */
+		target *t;
+		{
+			GDB_LOCK();
+			t = flash_claim() ? cur_target : NULL;
+		}
+#else
+		GDB_LOCK();
+		target *t = flash_claim() ? cur_target : NULL;
+#endif
+		bool written = false;
+		if(t && gdb_flash_inc_enabled())
+			written = gdb_flash_inc_write(t, addr, packet + bin, len);
+		else if(t)
+#ifdef CONFIG_GDB_FLASH_PIPELINE
+			written = gdb_flash_pipe_write(t, addr, packet + bin, len);
+#else
+			written = target_flash_write(t, addr, (void*)(packet + bin), len);
+#endif
+		if(written) {
 			gdb_putpacketz("OK");
 		} else {
 			flash_mode = 0;
 			gdb_putpacketz("EFF");
 		}
-	} else if (!strncmp(packet, "vCont", 5)) {
+		break;
+	}
+	case V_CONT: {
 		GDB_LOCK();
 		char* c = packet+5;
 		if(*c == ';') c++;
@@ -825,9 +1524,12 @@ GDB::handle_v_packet(char *packet, int plen)
 			}
 			c++;
 		}
+		if(run_state)
+			halt_poll_start();
 		gdb_putpacketz("OK");
-
-	} else if (!strncmp(packet, "vKill;", 6)) {
+		break;
+	}
+	case V_KILL: {
 		GDB_LOCK();
 		/* Kill the target - we don't actually care about the PID that follows "vKill;" */
 		if (cur_target) {
@@ -837,19 +1539,40 @@ GDB::handle_v_packet(char *packet, int plen)
 			cur_target = NULL;
 		}
 		gdb_putpacketz("OK");
-
-	} else if (!strcmp(packet, "vFlashDone")) {
+		break;
+	}
+	case V_FLASH_DONE: {
 		/* Commit flash operations. */
+		bool written = true;
+		{
+			GDB_LOCK();
+			if(!flash_claim()) { gdb_putpacketz("EFF"); return; }
+		}
+		if(flash_mode && gdb_flash_inc_enabled()) {
+			/* Not locked across, the sectors may be queued for programming */
+			target *t;
+			{
+				GDB_LOCK();
+				t = cur_target;
+			}
+			written = t && gdb_flash_inc_done(t);
+		}
+		written = gdb_flash_pipe_done() && written;
 		GDB_LOCK();
-		gdb_putpacketz(target_flash_complete(cur_target) ? "OK" : "EFF");
+		gdb_putpacketz(written && target_flash_complete(cur_target) ? "OK" : "EFF");
 		flash_mode = 0;
-	} else if (!strcmp(packet, "vStopped")) {
+		flash_owner = nullptr;
+		break;
+	}
+	case V_STOPPED: {
 		if (gdb_needs_detach_notify) {
 			gdb_putpacketz("W00");
 			gdb_needs_detach_notify = false;
 		} else
 			gdb_putpacketz("OK");
-	} else {
+		break;
+	}
+	default:
 		DEBUG_GDB("*** Unsupported packet: %s\n", packet);
 		gdb_putpacket("", 0);
 	}
@@ -861,15 +1584,15 @@ GDB::handle_z_packet(char *packet, int plen)
 	(void)plen;
 
 	uint8_t set = (packet[0] == 'Z') ? 1 : 0;
-	int type, len;
-	uint32_t addr;
+	int type;
+	uint32_t addr, len;
 	int ret;
 	GDB_LOCK();
-	/* I have no idea why this doesn't work. Seems to work
-	 * with real sscanf() though... */
-	//sscanf(packet, "%*[zZ]%hhd,%08lX,%hhd", &type, &addr, &len);
 	type = packet[1] - '0';
-	sscanf(packet + 2, ",%" PRIx32 ",%d", &addr, &len);
+	if (packet[2] != ',' || !gdb_hex_addr_len(packet + 3, &addr, &len)) {
+		gdb_putpacketz("E01");
+		return;
+	}
 	if(set)
 		ret = target_breakwatch_set(cur_target, (target_breakwatch)type, addr, len);
 	else
@@ -0,0 +1,123 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "sdkconfig.h"
+
+#ifdef CONFIG_GDB_READ_CACHE
+
+extern "C" {
+#include "general.h"
+#include "gdb_packet.h"
+#include "target.h"
+#include "target/target_internal.h"
+}
+
+#include "gdb_if.hpp"
+#include "gdb_memcache.hpp"
+
+#define CACHE_LINES	4
+#define CACHE_LINE_SIZE	256
+
+struct cache_line {
+	target_addr_t addr;
+	uint32_t len;
+	uint32_t stamp;
+	bool valid;
+	uint8_t data[CACHE_LINE_SIZE];
+};
+
+static cache_line lines[CACHE_LINES];
+static target *cache_target;
+static bool cache_enabled = true;
+static uint32_t cache_hits, cache_misses;
+
+void gdb_mem_cache_invalidate()
+{
+	GDB_LOCK();
+	for (cache_line &l : lines)
+		l.valid = false;
+}
+
+/* Finds the aligned block around src, clipped to the RAM region holding
+ * it. Reads outside RAM, or crossing a block boundary, aren't cached so
+ * that peripheral registers are never read behind the debugger's back.
+ */
+static bool cache_block(target *t, target_addr_t src, size_t len,
+			target_addr_t *start, uint32_t *size)
+{
+	for (struct target_ram *r = t->ram; r; r = r->next) {
+		if (src < r->start || src + len > r->start + r->length)
+			continue;
+		target_addr_t lo = src & ~(target_addr_t)(CACHE_LINE_SIZE - 1);
+		target_addr_t hi = lo + CACHE_LINE_SIZE;
+		if (src + len > hi)
+			return false;
+		if (lo < r->start)
+			lo = r->start;
+		if (hi > r->start + r->length)
+			hi = r->start + r->length;
+		*start = lo;
+		*size = hi - lo;
+		return true;
+	}
+	return false;
+}
+
+int gdb_mem_cache_read(target *t, void *dest, target_addr_t src, size_t len)
+{
+	GDB_LOCK();
+	if (t != cache_target) {
+		gdb_mem_cache_invalidate();
+		cache_target = t;
+	}
+
+	target_addr_t start;
+	uint32_t size;
+	if (!cache_enabled || len == 0 || len > CACHE_LINE_SIZE ||
+	    !cache_block(t, src, len, &start, &size))
+		return target_mem_read(t, dest, src, len);
+
+	uint32_t now = platform_time_ms();
+	cache_line *victim = &lines[0];
+	for (cache_line &l : lines) {
+		bool fresh = l.valid && now - l.stamp < CONFIG_GDB_READ_CACHE_MS;
+		if (fresh && src >= l.addr && src + len <= l.addr + l.len) {
+			memcpy(dest, l.data + (src - l.addr), len);
+			cache_hits++;
+			return 0;
+		}
+		if (!fresh)
+			l.valid = false;
+		/* Reuse a free line first, then the oldest one */
+		if (victim->valid && (!l.valid || (int32_t)(l.stamp - victim->stamp) < 0))
+			victim = &l;
+	}
+
+	cache_misses++;
+	victim->valid = false;
+	if (target_mem_read(t, victim->data, start, size))
+		return target_mem_read(t, dest, src, len);
+	victim->addr = start;
+	victim->len = size;
+	victim->stamp = now;
+	victim->valid = true;
+	memcpy(dest, victim->data + (src - start), len);
+	return 0;
+}
+
+bool gdb_mem_cache_command(target *t, int argc, const char **argv)
+{
+	(void)t;
+	GDB_LOCK();
+	if (argc == 2) {
+		cache_enabled = !strcmp(argv[1], "enable");
+		cache_hits = cache_misses = 0;
+		gdb_mem_cache_invalidate();
+	}
+	gdb_outf("Read cache: %s, %u hits, %u misses, %u ms window\n",
+		cache_enabled ? "enabled" : "disabled", cache_hits, cache_misses,
+		CONFIG_GDB_READ_CACHE_MS);
+	return true;
+}
+
+#endif
@@ -0,0 +1,27 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sdkconfig.h"
+
+extern "C" {
+#include "target.h"
+}
+
+/* Short lived cache for small target memory reads. Repeated polling of
+ * nearby variables, as done by IDE live expression views, is served from
+ * a few aligned RAM blocks instead of one transfer per variable. Entries
+ * expire after CONFIG_GDB_READ_CACHE_MS and are dropped whenever the
+ * target is written, resumed or reset.
+ */
+#ifdef CONFIG_GDB_READ_CACHE
+int gdb_mem_cache_read(target *t, void *dest, target_addr_t src, size_t len);
+void gdb_mem_cache_invalidate();
+bool gdb_mem_cache_command(target *t, int argc, const char **argv);
+#else
+static inline int gdb_mem_cache_read(target *t, void *dest, target_addr_t src, size_t len)
+{
+	return target_mem_read(t, dest, src, len);
+}
+static inline void gdb_mem_cache_invalidate() {}
+#endif
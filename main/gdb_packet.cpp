@@ -33,238 +33,703 @@ extern "C" {
 #include <stdarg.h>
 
 #include "gdb_if.hpp"
+#include "gdb_hex.hpp"
+#include "task.h"
 
 
-int GDB::gdb_getpacket(char *packet, int size)
+/* Packet parser state machine. Works on whatever span of input the
+ * transport has buffered: frame boundaries are located in bulk and the
+ * payload is unescaped and checksummed in a single pass. The state is kept
+ * in the object so a frame may be split across any number of spans.
+ * Returns the number of bytes consumed, stopping right after a frame
+ * (or other event) completes so the caller can handle it.
+ */
+size_t GDB::gdb_rx_feed(const unsigned char *data, size_t len)
 {
-	unsigned char c;
-	unsigned char csum;
-	char recv_csum[3];
-	int i;
+	const unsigned char *p = data;
+	const unsigned char *const end = data + len;
 
-	while(1) {
-	    /* Wait for packet start */
-		do {
+	rx_event = RX_EV_NONE;
+	while (p < end && rx_event == RX_EV_NONE) {
+		char *const packet = pbuf;
+		const int size = pbuf_size - 1;
+
+		switch (rx_state) {
+		case RX_IDLE:
 			/* Spin waiting for a start of packet character - either a gdb
-             * start ('$') or a BMP remote packet start ('!').
+			 * start ('$') or a BMP remote packet start ('!').
 			 */
-			do {
-				packet[0] = gdb_if_getchar_to(20);
-				if(packet[0] == 0xFF) return 0;
-
-				if (packet[0]==0x04) return 1;
-				if (packet[0]==0x03) return 1;
-			} while ((packet[0] != '$') && (packet[0] != REMOTE_SOM));
+			while (p < end) {
+				unsigned char c = *p++;
+				if (c == '+' || c == '-') {
+					gdb_ack_received(c == '+');
+					continue;
+				}
+				/* Anything else starts a packet and needs a buffer */
+				if (!pbuf && (c == '$' || c == REMOTE_SOM || c == 0x03 || c == 0x04) &&
+					!gdb_pbuf_acquire(false)) {
+					p--;
+					rx_event = RX_EV_NOBUF;
+					break;
+				}
+				if (c == '$') {
+					rx_state = RX_DATA;
+					rx_len = 0;
+					rx_csum = 0;
+					break;
+				}
 #if PC_HOSTED == 0
-			if (packet[0]==REMOTE_SOM) {
-				/* This is probably a remote control packet
-				 * - get and handle it */
-				i=0;
-				bool gettingRemotePacket=true;
-				while (gettingRemotePacket) {
-					c=gdb_if_getchar();
-					switch (c) {
-					case REMOTE_SOM: /* Oh dear, packet restarts */
-						i=0;
-						break;
-
-					case REMOTE_EOM:{ /* Complete packet for processing */
-						packet[i]=0;
-						GDB_LOCK();
-						remote_packet_process(i,packet);
-						gettingRemotePacket=false;
-						break;
-					}
-					case '$': /* A 'real' gdb packet, best stop squatting now */
-						packet[0]='$';
-						gettingRemotePacket=false;
-						break;
-
-					default:
-						if (i<size) {
-							packet[i++]=c;
-						} else {
-							/* Who knows what is going on...return to normality */
-							gettingRemotePacket=false;
-						}
+				if (c == REMOTE_SOM) {
+					rx_state = RX_REMOTE;
+					rx_len = 0;
+					break;
+				}
+#endif
+				if (c == 0x03 || c == 0x04) {
+					pbuf[0] = c;
+					rx_len = 1;
+					rx_event = RX_EV_INTERRUPT;
+					break;
+				}
+			}
+			break;
+
+		case RX_DATA: {
+			/* Find the end of the frame in this span, then unescape and
+			 * checksum everything up to it in one go. */
+			const unsigned char *hash = (const unsigned char *)memchr(p, '#', end - p);
+			const unsigned char *stop = hash ? hash : end;
+			uint8_t csum = rx_csum;
+			int i = rx_len;
+			bool overflow = false;
+
+			while (p < stop) {
+				unsigned char c = *p;
+				if (c == '$') { /* Restart capture */
+					p++;
+					i = 0;
+					csum = 0;
+					continue;
+				}
+				if (i == size) { /* Oh shit */
+					overflow = true;
+					break;
+				}
+				p++;
+				if (c == '}') { /* escaped char */
+					csum += c;
+					if (p == stop) {
+						/* Escaped byte is in the next span */
+						rx_state = RX_ESCAPE;
 						break;
 					}
+					c = *p++;
+					csum += c;
+					packet[i++] = c ^ 0x20;
+					continue;
 				}
-				/* Reset the packet buffer start character to zero, because function
-				 * 'remotePacketProcess()' above overwrites this buffer, and
-				 * an arbitrary character may have been placed there. If this is a '$'
-				 * character, this will cause this loop to be terminated, which is wrong.
-				 */
-				packet[0] = 0;
+				csum += c;
+				packet[i++] = c;
 			}
-#endif
-	    } while (packet[0] != '$');
+			rx_csum = csum;
+			rx_len = i;
+
+			if (overflow) {
+				gdb_rx_overflow();
+			} else if (rx_state == RX_DATA && p == hash) {
+				p++;
+				rx_state = RX_CSUM_HI;
+			}
+			break;
+		}
 
-		i = 0; csum = 0;
-		/* Capture packet data into buffer */
-		while((c = gdb_if_getchar()) != '#') {
+		case RX_ESCAPE: {
+			if (rx_len == size) {
+				gdb_rx_overflow();
+				break;
+			}
+			unsigned char c = *p++;
+			rx_csum += c;
+			packet[rx_len++] = c ^ 0x20;
+			rx_state = RX_DATA;
+			break;
+		}
+
+		case RX_CSUM_HI: {
+			int hi = gdb_unhex_digit(*p++);
+			rx_recv_csum = hi < 0 ? -1 : hi << 4;
+			rx_state = RX_CSUM_LO;
+			break;
+		}
 
-			if(i == size) break; /* Oh shit */
+		case RX_CSUM_LO: {
+			int lo = gdb_unhex_digit(*p++);
+			rx_state = RX_IDLE;
+			if (rx_recv_csum >= 0 && lo >= 0 && (uint8_t)(rx_recv_csum | lo) == rx_csum) {
+				if (!no_ack_mode)
+					gdb_if_putchar('+', 1); /* send ack */
+				packet[rx_len] = 0;
+				rx_event = RX_EV_PACKET;
+			} else if (!no_ack_mode) {
+				gdb_if_putchar('-', 1); /* send nack */
+			}
+			break;
+		}
 
-			if(c == '$') { /* Restart capture */
-				i = 0;
-				csum = 0;
-				continue;
+		case RX_DISCARD:
+			/* Rest of an overflowed frame, its payload must not be taken
+			 * for acks. A '$' means the sender started over. */
+			while (p < end) {
+				unsigned char c = *p++;
+				if (c == '#') {
+					rx_state = RX_DISCARD_CSUM;
+					rx_len = 0;
+					break;
+				}
+				if (c == '$') {
+					rx_state = RX_DATA;
+					rx_len = 0;
+					rx_csum = 0;
+					break;
+				}
 			}
-			if(c == '}') { /* escaped char */
-				c = gdb_if_getchar();
-				csum += c + '}';
-				packet[i++] = c ^ 0x20;
-				continue;
+			break;
+
+		case RX_DISCARD_CSUM:
+			p++;
+			if (++rx_len == 2) {
+				rx_len = 0;
+				rx_state = RX_IDLE;
+				if (!no_ack_mode)
+					gdb_if_putchar('-', 1);
 			}
-			csum += c;
-			packet[i++] = c;
+			break;
+
+		case RX_REMOTE:
+			/* This is probably a remote control packet */
+			while (p < end) {
+				unsigned char c = *p++;
+				if (c == REMOTE_SOM) { /* Oh dear, packet restarts */
+					rx_len = 0;
+				} else if (c == REMOTE_EOM) { /* Complete packet for processing */
+					packet[rx_len] = 0;
+					rx_state = RX_IDLE;
+					rx_event = RX_EV_REMOTE;
+					break;
+				} else if (c == '$') { /* A 'real' gdb packet, best stop squatting now */
+					rx_state = RX_DATA;
+					rx_len = 0;
+					rx_csum = 0;
+					break;
+				} else if (rx_len < size) {
+					packet[rx_len++] = c;
+				} else {
+					/* Who knows what is going on...return to normality */
+					rx_state = RX_IDLE;
+					break;
+				}
+			}
+			break;
 		}
-		recv_csum[0] = gdb_if_getchar();
-		recv_csum[1] = gdb_if_getchar();
-		recv_csum[2] = 0;
+	}
+	return p - data;
+}
 
-		/* return packet if checksum matches */
-		if(csum == strtol(recv_csum, NULL, 16)) break;
+/* Frame too large for the packet buffer. The rest of it is skipped up to
+ * the checksum before it is nacked, see RX_DISCARD. */
+void GDB::gdb_rx_overflow()
+{
+	rx_state = RX_DISCARD;
+}
 
-		/* get here if checksum fails */
-		if(!no_ack_mode)
-			gdb_if_putchar('-', 1); /* send nack */
+/* Acts on the event the parser stopped at. Returns the packet length when
+ * one is ready, 0 to keep reading and -1 when no packet buffer was free.
+ */
+int GDB::gdb_rx_event()
+{
+	switch (rx_event) {
+	case RX_EV_NOBUF:
+		return -1;
+	case RX_EV_INTERRUPT:
+		pbuf[1] = 0;
+		return 1;
+#if PC_HOSTED == 0
+	case RX_EV_REMOTE: {
+		{
+			GDB_LOCK();
+			remote_packet_process(rx_len, pbuf);
+		}
+		gdb_pbuf_release();
+		return 0;
 	}
-	if(!no_ack_mode)
-		gdb_if_putchar('+', 1); /* send ack */
-	packet[i] = 0;
-
+#endif
+	case RX_EV_PACKET:
 #if PC_HOSTED == 1
-	DEBUG_GDB_WIRE("%s : ", __func__);
-	for(int j = 0; j < i; j++) {
-		c = packet[j];
-		if ((c >= 32) && (c < 127))
-			DEBUG_GDB_WIRE("%c", c);
-		else
-			DEBUG_GDB_WIRE("\\x%02X", c);
-	}
-	DEBUG_GDB_WIRE("\n");
+		DEBUG_GDB_WIRE("%s : ", __func__);
+		for(int j = 0; j < rx_len; j++) {
+			unsigned char c = pbuf[j];
+			if ((c >= 32) && (c < 127))
+				DEBUG_GDB_WIRE("%c", c);
+			else
+				DEBUG_GDB_WIRE("\\x%02X", c);
+		}
+		DEBUG_GDB_WIRE("\n");
 #endif
-	return i;
+		return rx_len;
+	default:
+		return 0;
+	}
 }
 
-void GDB::gdb_next_char(const char c, uint8_t *const csum)
+/* Parses what the transport has buffered without ever blocking */
+int GDB::gdb_rx_poll()
 {
-#if PC_HOSTED == 1
-	if (c >= 32 && c < 127)
-		DEBUG_GDB_WIRE("%c", c);
-	else
-		DEBUG_GDB_WIRE("\\x%02X", c);
-#endif
-	if (c == '$' || c == '#' || c == '}' || c == '*') {
-		gdb_if_putchar('}', 0);
-		gdb_if_putchar(c ^ 0x20U, 0);
-		*csum += '}' + (c ^ 0x20U);
+	while(1) {
+		const unsigned char *span;
+		size_t n = gdb_if_rxspan(&span);
+
+		if (!n)
+			return 0;
+		gdb_if_rxconsume(gdb_rx_feed(span, n));
+		int ret = gdb_rx_event();
+		if (ret)
+			return ret;
+	}
+}
+
+int GDB::gdb_getpacket()
+{
+	while(1) {
+		int ret = gdb_rx_poll();
+		if (ret > 0)
+			return ret;
+		if (ret < 0) {
+			gdb_pbuf_acquire(true);
+			continue;
+		}
+
+		/* Nothing buffered, the byte path blocks and refills */
+		unsigned char c;
+		if (rx_state == RX_IDLE) {
+			c = gdb_if_getchar_to(20);
+			if (c == 0xFF) {
+				gdb_ack_poll();
+				return 0;
+			}
+		} else {
+			c = gdb_if_getchar();
+		}
+		while (gdb_rx_feed(&c, 1) == 0)
+			gdb_pbuf_acquire(true);
+		ret = gdb_rx_event();
+		if (ret > 0)
+			return ret;
+	}
+}
+
+bool GDB::gdb_pbuf_acquire(bool wait)
+{
+	if (pbuf)
+		return true;
+	if (wait) {
+		/* Let other clients finish with the target and their buffers */
+		GDBBreakLock brk;
+		while (!(pbuf = gdb_bufpool_get(true, pkt_size + 1, &pbuf_size)))
+			vTaskDelay(10 / portTICK_PERIOD_MS);
 	} else {
-		gdb_if_putchar(c, 0);
-		*csum += c;
+		pbuf = gdb_bufpool_get(false, pkt_size + 1, &pbuf_size);
 	}
+	return pbuf != NULL;
 }
 
-void GDB::gdb_putpacket(const char *packet, int size, char pktstart)
+void GDB::gdb_pbuf_release()
 {
-	int i;
-	unsigned char csum;
-	unsigned char c;
-	char xmit_csum[3];
-	int tries = 0;
+	if (rx_state != RX_IDLE)
+		return;
+	gdb_bufpool_put(pbuf);
+	pbuf = NULL;
+	pbuf_size = 0;
+}
 
-	do {
-		DEBUG_GDB_WIRE("%s : ", __func__);
-		csum = 0;
-		gdb_if_putchar(pktstart, 0);
-		for(i = 0; i < size; i++) {
-			c = packet[i];
+/* Characters that have to be escaped in a frame: '#', '$', '*' and '}' */
+static const uint32_t gdb_escape_map[8] = {
+	0x00000000, 0x00000418, 0x00000000, 0x20000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000,
+};
+
+static inline bool gdb_needs_escape(uint8_t c)
+{
+	return gdb_escape_map[c >> 5] & (1U << (c & 31));
+}
+
+/* Only one acknowledged frame is in flight at a time, so a '-' always
+ * refers to the frame in the retransmit slot. The slot starts at the TX
+ * buffer size and grows up to a fully escaped frame of the client's
+ * packet size. Acks are collected by the parser, see gdb_ack_received(),
+ * and by gdb_ack_wait() before the next frame goes out. */
+#define GDB_ACK_TIMEOUT_MS 500
+#define GDB_RETX_TRIES 3
+
+/* Longest run one RLE sequence can describe, the count character is n + 29
+ * and has to stay at or below '~' */
+#define GDB_RLE_MAX ('~' - 29)
+
+static const char gdb_hexdigits[] = "0123456789ABCDEF";
+
+/* Frame encoder. The payload is escaped and checksummed straight into the
+ * transport's TX buffer, which is only handed to the socket when the frame
+ * is complete (or, for oversized frames, when the buffer fills up).
+ */
+void GDB::gdb_frame_begin(char pktstart)
+{
+	if (pktstart == '$' && !no_ack_mode)
+		gdb_ack_wait();
+
+	size_t avail;
+	uint8_t *out = gdb_if_txspace(&avail);
+
+	if (avail < 1) {
+		gdb_if_txcommit(0, 1);
+		out = gdb_if_txspace(&avail);
+	}
+	DEBUG_GDB_WIRE("%s : ", __func__);
+	/* Only '$' frames are acknowledged, notifications never are */
+	tx_track = pktstart == '$' && !no_ack_mode;
+	if (tx_track) {
+		if (!retx_buf) {
+			retx_size = pkt_size + 4;
+			retx_buf = (uint8_t *)malloc(retx_size);
+			if (!retx_buf)
+				retx_size = 0;
+		}
+		retx_len = 0;
+		retx_lost = false;
+	} else if (no_ack_mode && !ack_pending && retx_buf) {
+		free(retx_buf);
+		retx_buf = NULL;
+		retx_size = 0;
+	}
+	*out = pktstart;
+	gdb_tx_commit(out, 1, 0);
+	tx_csum = 0;
+}
+
+void GDB::gdb_frame_append(const void *data, size_t len)
+{
+	const uint8_t *p = (const uint8_t *)data;
+	const uint8_t *const end = p + len;
+	uint8_t csum = tx_csum;
+
+	while (p < end) {
+		size_t avail;
+		uint8_t *out = gdb_if_txspace(&avail);
+		if (avail < 3) {
+			gdb_if_txcommit(0, 1);
+			continue;
+		}
+		uint8_t *const start = out;
+		uint8_t *const limit = out + avail - 2;
+
+		while (p < end && out < limit) {
+			uint8_t c = *p++;
 #if PC_HOSTED == 1
 			if ((c >= 32) && (c < 127))
 				DEBUG_GDB_WIRE("%c", c);
 			else
 				DEBUG_GDB_WIRE("\\x%02X", c);
 #endif
-			if((c == '$') || (c == '#') || (c == '}') || (c == '*')) {
-				gdb_if_putchar('}', 0);
-				gdb_if_putchar(c ^ 0x20, 0);
-				csum += '}' + (c ^ 0x20);
-			} else {
-				gdb_if_putchar(c, 0);
-				csum += c;
+			if (rle_enabled && p < end && *p == c) {
+				/* Run length encoding: c '*' (n + 29) stands for c
+				 * followed by n more copies. n + 29 has to be printable
+				 * and must not be '#' or '$'. */
+				size_t n = 1;
+				const size_t max = end - p < GDB_RLE_MAX ? end - p : GDB_RLE_MAX;
+				while (n < max && p[n] == c)
+					n++;
+				if (n >= 3 && !gdb_needs_escape(c)) {
+					while (n + 29 == '#' || n + 29 == '$')
+						n--;
+					out[0] = c;
+					out[1] = '*';
+					out[2] = n + 29;
+					out += 3;
+					csum += c + '*' + (n + 29);
+					p += n;
+					continue;
+				}
+			}
+			if (gdb_needs_escape(c)) {
+				*out++ = '}';
+				c ^= 0x20;
+				csum += '}';
 			}
+			*out++ = c;
+			csum += c;
 		}
-		gdb_if_putchar('#', 0);
-		snprintf(xmit_csum, sizeof(xmit_csum), "%02X", csum);
-		gdb_if_putchar(xmit_csum[0], 0);
-		gdb_if_putchar(xmit_csum[1], 1);
-		DEBUG_GDB_WIRE("\n");
-	} while(!no_ack_mode && (gdb_if_getchar_to(2000) != '+') && (tries++ < 3));
+		gdb_tx_commit(start, out - start, 0);
+	}
+	tx_csum = csum;
+}
+
+void GDB::gdb_frame_end()
+{
+	size_t avail;
+	uint8_t *out = gdb_if_txspace(&avail);
+
+	if (avail < 3) {
+		gdb_if_txcommit(0, 1);
+		out = gdb_if_txspace(&avail);
+	}
+	out[0] = '#';
+	out[1] = gdb_hexdigits[tx_csum >> 4];
+	out[2] = gdb_hexdigits[tx_csum & 0xf];
+	gdb_tx_commit(out, 3, 1);
+	DEBUG_GDB_WIRE("\n");
+
+	if (tx_track) {
+		tx_track = false;
+		ack_pending = true;
+		retx_tries = 0;
+		retx_time = platform_time_ms();
+	}
+}
+
+/* Queues bytes written to the TX buffer, keeping a copy of acknowledged
+ * frames in the retransmit slot.
+ */
+void GDB::gdb_tx_commit(const uint8_t *data, size_t len, int flush)
+{
+	if (tx_track && !retx_lost) {
+		if (retx_len + len > retx_size && !gdb_retx_grow(retx_len + len)) {
+			/* Only when out of memory, a nack can't be served */
+			retx_lost = true;
+		} else {
+			memcpy(retx_buf + retx_len, data, len);
+			retx_len += len;
+		}
+	}
+	gdb_if_txcommit(len, flush);
+}
+
+bool GDB::gdb_retx_grow(size_t need)
+{
+	const size_t max = 2 * pkt_size + 4;
+	if (need > max)
+		return false;
+	size_t size = retx_size * 2 < max ? retx_size * 2 : max;
+	if (size < need)
+		size = need;
+	uint8_t *buf = (uint8_t *)realloc(retx_buf, size);
+	if (!buf)
+		return false;
+	retx_buf = buf;
+	retx_size = size;
+	return true;
+}
+
+void GDB::gdb_retransmit()
+{
+	if (retx_len == 0 || retx_lost) {
+		DEBUG_WARN("gdb: frame not kept, can't retransmit");
+		ack_pending = false;
+		return;
+	}
+	const uint8_t *p = retx_buf;
+	size_t left = retx_len;
+	while (left) {
+		size_t avail;
+		uint8_t *out = gdb_if_txspace(&avail);
+		if (avail == 0) {
+			gdb_if_txcommit(0, 1);
+			continue;
+		}
+		size_t n = left < avail ? left : avail;
+		memcpy(out, p, n);
+		p += n;
+		left -= n;
+		gdb_if_txcommit(n, left == 0);
+	}
+	retx_tries++;
+	retx_time = platform_time_ms();
+}
+
+/* Called by the parser for every '+' or '-' outside of a frame */
+void GDB::gdb_ack_received(bool ack)
+{
+	if (!ack_pending)
+		return;
+	if (ack) {
+		ack_pending = false;
+		retx_len = 0;
+		if (no_ack_mode) {
+			free(retx_buf);
+			retx_buf = NULL;
+			retx_size = 0;
+		}
+	} else {
+		gdb_retransmit();
+	}
+}
+
+/* Called while idle, resends the last frame if its ack is overdue */
+void GDB::gdb_ack_poll()
+{
+	if (!ack_pending || platform_time_ms() - retx_time < GDB_ACK_TIMEOUT_MS)
+		return;
+	if (retx_tries < GDB_RETX_TRIES) {
+		gdb_retransmit();
+	} else {
+		DEBUG_WARN("gdb: no ack after %d retries, giving up", GDB_RETX_TRIES);
+		ack_pending = false;
+		retx_len = 0;
+	}
+}
+
+/* Waits for the ack of the frame in flight before the next one replaces
+ * it in the slot. Input other than '+' and '-' means the peer has moved
+ * on, the frame is given up rather than consuming its next packet. */
+void GDB::gdb_ack_wait()
+{
+	while (ack_pending) {
+		const unsigned char *span;
+		if (rx_state != RX_IDLE)
+			break;
+		if (!gdb_if_rxspan(&span)) {
+			if (!gdb_if_fill(GDB_ACK_TIMEOUT_MS))
+				gdb_ack_poll();
+			continue;
+		}
+		if (span[0] != '+' && span[0] != '-')
+			break;
+		gdb_if_rxconsume(1);
+		gdb_ack_received(span[0] == '+');
+	}
+	if (ack_pending) {
+		DEBUG_WARN("gdb: no ack before the next frame, giving up");
+		ack_pending = false;
+		retx_len = 0;
+	}
+}
+
+/* True when a '$' frame can go out without waiting for an ack. Acks that
+ * are already buffered are taken, nothing is read from the transport, so
+ * a task borrowing the connection never blocks here. */
+bool GDB::gdb_ack_ready()
+{
+	while (ack_pending && !no_ack_mode && rx_state == RX_IDLE) {
+		const unsigned char *span;
+		if (!gdb_if_rxspan(&span) || (span[0] != '+' && span[0] != '-'))
+			break;
+		gdb_if_rxconsume(1);
+		gdb_ack_received(span[0] == '+');
+	}
+	return !ack_pending || no_ack_mode;
+}
+
+void GDB::gdb_putpacket(const char *packet, int size, char pktstart)
+{
+	gdb_frame_begin(pktstart);
+	gdb_frame_append(packet, size);
+	gdb_frame_end();
+}
+
+/* Formatted packets are rendered into a bounded stack buffer and pushed
+ * through the frame encoder, so stop replies and console output never
+ * touch the heap. Output that doesn't fit is cut short and logged.
+ */
+#define GDB_FORMAT_SCRATCH 256
+
+/* Returns the length in buf, or -1. *cut is set when it was truncated */
+static int gdb_vformat(char *buf, size_t bufsize, bool *cut, const char *fmt, va_list ap)
+{
+	int size = vsnprintf(buf, bufsize, fmt, ap);
+	*cut = size >= (int)bufsize;
+	if (*cut) {
+		DEBUG_WARN("gdb: %d byte reply truncated to %d", size, (int)bufsize - 1);
+		size = bufsize - 1;
+	}
+	return size;
+}
+
+void GDB::gdb_vputpacket_f(char pktstart, const char *fmt, va_list ap)
+{
+	char buf[GDB_FORMAT_SCRATCH];
+	bool cut;
+	int size;
+
+	size = gdb_vformat(buf, sizeof(buf), &cut, fmt, ap);
+	if (size < 0)
+		return;
+	gdb_putpacket(buf, size, pktstart);
 }
 
 void GDB::gdb_putpacket_f(const char *fmt, ...)
 {
 	va_list ap;
-	char *buf;
-	int size;
 
 	va_start(ap, fmt);
-	size = vasprintf(&buf, fmt, ap);
-	gdb_putpacket(buf, size);
-	free(buf);
+	gdb_vputpacket_f('$', fmt, ap);
 	va_end(ap);
 }
+
 void GDB::gdb_putnotifpacket_f(const char *fmt, ...)
 {
 	va_list ap;
-	char *buf;
-	int size;
 
 	va_start(ap, fmt);
-	size = vasprintf(&buf, fmt, ap);
-	gdb_putpacket(buf, size, '%');
-	free(buf);
+	gdb_vputpacket_f('%', fmt, ap);
 	va_end(ap);
 }
 
-void GDB::gdb_out(const char *buf)
+/* Hex is produced in small chunks straight into the frame. Long output
+ * is split so no 'O' packet exceeds the client's packet size. */
+void GDB::gdb_out_n(const char *buf, size_t len)
 {
-	char *hexdata;
-	int i;
+	char hexdata[64];
+	const size_t frame_max = (pkt_size - 1) / 2;
+
+	do {
+		size_t left = len < frame_max ? len : frame_max;
+		len -= left;
+		gdb_frame_begin('$');
+		gdb_frame_append("O", 1);
+		while (left) {
+			size_t n = left < sizeof(hexdata) / 2 ? left : sizeof(hexdata) / 2;
+			gdb_hexify(hexdata, buf, n);
+			gdb_frame_append(hexdata, n * 2);
+			buf += n;
+			left -= n;
+		}
+		gdb_frame_end();
+	} while (len);
+}
 
-	hexdata = (char*)alloca((i = strlen(buf)*2 + 1) + 1);
-	hexdata[0] = 'O';
-	hexify(hexdata+1, buf, strlen(buf));
-	gdb_putpacket(hexdata, i);
+void GDB::gdb_out(const char *buf)
+{
+	gdb_out_n(buf, strlen(buf));
 }
 
 void GDB::gdb_put_notification(const char *const packet, const size_t size)
 {
-	char xmit_csum[3];
-
-	DEBUG_GDB_WIRE("%s: ", __func__);
-	uint8_t csum = 0;
-	gdb_if_putchar('%', 0);
-	for (size_t i = 0; i < size; ++i)
-		gdb_next_char(packet[i], &csum);
-	gdb_if_putchar('#', 0);
-	snprintf(xmit_csum, sizeof(xmit_csum), "%02X", csum);
-	gdb_if_putchar(xmit_csum[0], 0);
-	gdb_if_putchar(xmit_csum[1], 1);
-	DEBUG_GDB_WIRE("\n");
+	gdb_frame_begin('%');
+	gdb_frame_append(packet, size);
+	gdb_frame_end();
 }
 
 
 void GDB::gdb_voutf(const char *fmt, va_list ap)
 {
-	char *buf;
+	char buf[GDB_FORMAT_SCRATCH];
+	bool cut;
+	int size;
 
-	if (vasprintf(&buf, fmt, ap) < 0)
+	size = gdb_vformat(buf, sizeof(buf), &cut, fmt, ap);
+	if (size < 0)
 		return;
-	gdb_out(buf);
-	free(buf);
+	/* Let the user see the line was cut */
+	if (cut)
+		memcpy(buf + size - 4, "...\n", 4);
+	gdb_out_n(buf, size);
 }
 
 void GDB::gdb_outf(const char *fmt, ...)
@@ -279,23 +744,8 @@ void GDB::gdb_outf(const char *fmt, ...)
 
 void GDB::gdb_putpacket2(const char *const packet1, const size_t size1, const char *const packet2, const size_t size2)
 {
-	char xmit_csum[3];
-	size_t tries = 0;
-
-	do {
-		DEBUG_GDB_WIRE("%s: ", __func__);
-		uint8_t csum = 0;
-		gdb_if_putchar('$', 0);
-
-		for (size_t i = 0; i < size1; ++i)
-			gdb_next_char(packet1[i], &csum);
-		for (size_t i = 0; i < size2; ++i)
-			gdb_next_char(packet2[i], &csum);
-
-		gdb_if_putchar('#', 0);
-		snprintf(xmit_csum, sizeof(xmit_csum), "%02X", csum);
-		gdb_if_putchar(xmit_csum[0], 0);
-		gdb_if_putchar(xmit_csum[1], 1);
-		DEBUG_GDB_WIRE("\n");
-	} while (gdb_if_getchar_to(2000) != '+' && tries++ < 3U);
-}
\ No newline at end of file
+	gdb_frame_begin('$');
+	gdb_frame_append(packet1, size1);
+	gdb_frame_append(packet2, size2);
+	gdb_frame_end();
+}
@@ -0,0 +1,218 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "sdkconfig.h"
+#include "esp_log.h"
+#include "nvs.h"
+
+extern "C" {
+#include "general.h"
+#include "gdb_packet.h"
+#include "exception.h"
+#include "target.h"
+#include "target/adiv5.h"
+#include "target/cortexm.h"
+#include "target/target_internal.h"
+}
+
+#include "gdb_swdtune.hpp"
+
+extern "C" nvs_handle h_nvs_conf;
+
+#define TUNE_BYTES	256
+#define TUNE_ROUNDS	4
+/* PID4..CID3 of the SCS, constant on every Cortex-M */
+#define TUNE_ID_BASE	(CORTEXM_SCS_BASE + 0xfd0U)
+#define TUNE_ID_BYTES	48
+/* Percentage of the fastest clean step that is kept */
+#define TUNE_MARGIN	75
+
+static const uint32_t tune_steps[] = {
+	1000000, 2000000, 3000000, 4000000, 5000000, 6000000,
+	8000000, 10000000, 13000000, 16000000, 20000000,
+};
+
+/* The clock of the SWD engine is tuned, a JTAG-DP is left alone */
+static adiv5_debug_port_s *tune_dp(target *t)
+{
+	if (!t || !t->core || t->core[0] != 'M' || !t->ram)
+		return nullptr;
+	adiv5_debug_port_s *dp = cortexm_ap(t)->dp;
+	return dp->low_access == firmware_swdp_low_access ? dp : nullptr;
+}
+
+static void tune_key(char key[16], adiv5_debug_port_s *dp)
+{
+	snprintf(key, 16, "swd%08x", dp->debug_port_id);
+}
+
+static bool tune_access(target *t, void *buf, target_addr_t addr, size_t len, bool write)
+{
+	bool ok = false;
+	volatile struct exception e;
+	TRY_CATCH (e, EXCEPTION_ALL) {
+		if (write)
+			ok = !target_mem_write(t, addr, buf, len);
+		else
+			ok = !target_mem_read(t, buf, addr, len);
+		ok = ok && !target_check_error(t);
+	}
+	return ok && !e.type;
+}
+
+/* Clears sticky errors and resyncs the line after a failed pass */
+static void tune_recover(target *t)
+{
+	volatile struct exception e;
+	TRY_CATCH (e, EXCEPTION_ALL) {
+		target_check_error(t);
+	}
+}
+
+/* RAM may only be borrowed while the core is halted, another session
+ * could be running the target. DHCSR is read rather than polling the
+ * halt, which would consume the halt reason meant for that session. */
+static bool tune_halted(target *t)
+{
+	uint32_t dhcsr = 0;
+	volatile struct exception e;
+	TRY_CATCH (e, EXCEPTION_ALL) {
+		dhcsr = target_mem_read32(t, CORTEXM_DHCSR);
+	}
+	return !e.type && (dhcsr & CORTEXM_DHCSR_S_HALT);
+}
+
+/* Alternating bits, walking ones and a counter, varied by round. With
+ * ref set nothing is written, the area must read back as ref. */
+static bool tune_verify(target *t, target_addr_t addr, size_t len, int rounds, const uint32_t *ref)
+{
+	uint32_t out[TUNE_BYTES / 4];
+	uint32_t in[TUNE_BYTES / 4];
+
+	for (int round = 0; round < rounds; round++) {
+		if (ref) {
+			if (!tune_access(t, in, addr, len, false) || memcmp(in, ref, len))
+				return false;
+			continue;
+		}
+		for (size_t i = 0; i < len / 4; i++) {
+			switch ((i + round) % 3) {
+			case 0:
+				out[i] = (i & 1) ? 0xaaaaaaaa : 0x55555555;
+				break;
+			case 1:
+				out[i] = 1U << ((i + round) % 32);
+				break;
+			default:
+				out[i] = (round + 1) * 0x9e3779b9U + i;
+			}
+		}
+		if (!tune_access(t, out, addr, len, true) || !tune_access(t, in, addr, len, false) ||
+		    memcmp(in, out, len))
+			return false;
+	}
+	return true;
+}
+
+/* Returns the clock left set, 0 when no clock passed. A saved clock is
+ * only verified, the steps are only tried without one. A running target
+ * is tuned with reads of the SCS peripheral and component ID registers,
+ * taken at the starting clock as the reference.
+ */
+static uint32_t tune_clock(target *t, uint32_t saved)
+{
+	const uint32_t start = swdptap_get_frequency();
+	const bool halted = tune_halted(t);
+	target_addr_t addr = t->ram->start;
+	size_t len = (t->ram->length < TUNE_BYTES ? t->ram->length : TUNE_BYTES) & ~3U;
+	uint32_t ram[TUNE_BYTES / 4];
+	const uint32_t *ref = nullptr;
+
+	if (!halted) {
+		addr = TUNE_ID_BASE;
+		len = TUNE_ID_BYTES;
+		ref = ram;
+	}
+	if (len < 16 || !tune_access(t, ram, addr, len, false))
+		return 0;
+
+	uint32_t freq = 0;
+	if (saved) {
+		swdptap_set_frequency(saved);
+		if (tune_verify(t, addr, len, TUNE_ROUNDS, ref))
+			freq = saved;
+		else
+			ESP_LOGW("SWD", "saved clock %u Hz failed, \"monitor autotune\" retunes", saved);
+	} else {
+		uint32_t good = 0;
+		uint32_t last = 0;
+		for (uint32_t step : tune_steps) {
+			swdptap_set_frequency(step);
+			const uint32_t actual = swdptap_get_frequency();
+			/* The bit engine is already at its fastest */
+			if (actual == last)
+				break;
+			last = actual;
+			if (!tune_verify(t, addr, len, TUNE_ROUNDS, ref))
+				break;
+			good = actual;
+		}
+		freq = good / 100 * TUNE_MARGIN;
+	}
+
+	swdptap_set_frequency(freq ? freq : start);
+	tune_recover(t);
+	if (halted && !tune_access(t, ram, addr, len, true))
+		ESP_LOGE("SWD", "could not restore RAM at %08x", addr);
+	return freq;
+}
+
+static uint32_t tune_run(target *t, adiv5_debug_port_s *dp, bool use_saved)
+{
+	char key[16];
+	uint32_t saved = 0;
+
+	tune_key(key, dp);
+	if (use_saved && nvs_get_u32(h_nvs_conf, key, &saved) != ESP_OK)
+		saved = 0;
+
+	const uint32_t freq = tune_clock(t, saved);
+	if (freq && freq != saved)
+		nvs_set_u32(h_nvs_conf, key, freq);
+	ESP_LOGI("SWD", "IDCODE %08x: clock %u Hz%s", dp->debug_port_id, swdptap_get_frequency(),
+		 !freq ? " (tuning failed)" : freq == saved ? " (saved)" : "");
+	return freq;
+}
+
+#ifdef CONFIG_GDB_SWD_TUNE
+void gdb_swd_tune(target *t)
+{
+	adiv5_debug_port_s *dp = tune_dp(t);
+	if (dp && !platform_frequency_user)
+		tune_run(t, dp, true);
+}
+#endif
+
+bool gdb_swd_tune_command(target *t, int argc, const char **argv)
+{
+	adiv5_debug_port_s *dp = tune_dp(t);
+	if (!dp) {
+		gdb_outf("Needs a Cortex-M target with RAM\n");
+		return true;
+	}
+	if (argc == 2 && !strcmp(argv[1], "clear")) {
+		char key[16];
+		tune_key(key, dp);
+		nvs_erase_key(h_nvs_conf, key);
+		gdb_outf("Forgot the clock for IDCODE %08x\n", dp->debug_port_id);
+		return true;
+	}
+	/* Asked for, so later connects tune again even after "frequency" */
+	platform_frequency_user = false;
+	const uint32_t freq = tune_run(t, dp, false);
+	if (freq)
+		gdb_outf("IDCODE %08x: SWD clock %u Hz saved\n", dp->debug_port_id, freq);
+	else
+		gdb_outf("Tuning failed, clock left at %u Hz\n", swdptap_get_frequency());
+	return true;
+}
@@ -0,0 +1,29 @@
+#pragma once
+#include <stdint.h>
+
+#include "sdkconfig.h"
+
+extern "C" {
+#include "target.h"
+}
+
+/* SWD clock tuning. The clock is raised step by step while a pattern is
+ * written to and read back from target RAM, the fastest clean step less
+ * a safety margin is kept and saved in NVS under the DP IDCODE. Later
+ * connects to a DP with the same IDCODE only verify the saved clock, the
+ * sweep runs again on request. Nothing is tuned once the clock was set
+ * with "monitor frequency". Only Cortex-M targets on SW-DP with known
+ * RAM are tuned. RAM is only borrowed, and then restored, while the core
+ * is halted, a running core is tuned with reads of its ID registers.
+ * Callers hold the target lock.
+ */
+#ifdef CONFIG_GDB_SWD_TUNE
+void gdb_swd_tune(target *t);
+#else
+static inline void gdb_swd_tune(target *t)
+{
+	(void)t;
+}
+#endif
+/* Retunes regardless of a saved clock, or forgets it */
+bool gdb_swd_tune_command(target *t, int argc, const char **argv);
@@ -0,0 +1,21 @@
+#pragma once
+#include <stddef.h>
+
+/* Byte stream under a GDB connection. Everything moves in spans, the
+ * packet layer keeps its own receive and transmit buffers on top.
+ */
+class GDB_transport {
+public:
+    virtual ~GDB_transport() {}
+
+    /* Waits up to timeout ms (-1 forever) until read_some has something
+     * to return, false on timeout */
+    virtual bool wait_input(int timeout) = 0;
+    /* Never blocks: returns the number of bytes read, 0 if nothing was
+     * pending or -1 once the peer has gone */
+    virtual int read_some(void *buf, size_t len) = 0;
+    /* Sends all of buf, false once the peer has gone */
+    virtual bool write_all(const void *buf, size_t len) = 0;
+    /* Pushes out data the transport buffered itself */
+    virtual bool flush() { return true; }
+};
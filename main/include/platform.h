@@ -92,8 +92,35 @@ void platform_set_baud(uint32_t baud);
 
 #define PLATFORM_HAS_DEBUG 
 #define PLATFORM_IDENT "esp8266"
+
+/* CCOUNT rate, the SDK's boot clock */
+#define PLATFORM_CPU_HZ	(CONFIG_ESP8266_DEFAULT_CPU_FREQ_MHZ * 1000000U)
+
+/* CPU cycle counter, paces the clock edges of the IRAM bit engines */
+static inline uint32_t platform_ccount(void)
+{
+	uint32_t ccount;
+	__asm__ __volatile__("rsr %0, ccount" : "=a"(ccount));
+	return ccount;
+}
 #endif
 
 extern bool debug_bmp;
 
-extern uint32_t swd_delay_cnt;
+/* SWD clock of the IRAM bit engine in swdptap.c */
+void swdptap_set_frequency(uint32_t freq);
+uint32_t swdptap_get_frequency(void);
+/* TCK of the IRAM JTAG engine in jtagtap.c */
+void jtagtap_set_frequency(uint32_t freq);
+uint32_t jtagtap_get_frequency(void);
+/* Set by platform_max_frequency_set(), i.e. "monitor frequency", the SWD
+ * tuner then leaves the clock alone */
+extern bool platform_frequency_user;
+/* Set by jtagtap_init(), cleared by swdptap_init(): the engine the last
+ * scan brought up, whose clock platform_max_frequency_get() reports */
+extern bool platform_jtag_active;
+
+struct adiv5_debug_port;
+/* Routes aligned word blocks through the queued transfers in swdp_queue.c,
+ * only for DPs found by the SWD scan */
+void swdp_queue_attach(struct adiv5_debug_port *dp);
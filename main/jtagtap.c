@@ -0,0 +1,256 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* JTAG TAP driver for the ESP8266, replacing the common jtagtap.c.
+ *
+ * Like swdptap.c it runs from IRAM and paces TCK with CCOUNT. IR/DR scans
+ * are shifted a 32 bit word at a time with the loop unrolled, the data is
+ * loaded and stored as whole words and only the tail of a scan, which
+ * carries the final TMS bit, goes bit by bit. TMS walks are clocked in
+ * one pass with TDI held high.
+ */
+
+#include <string.h>
+
+#include "general.h"
+#include "platform.h"
+#include "jtagtap.h"
+
+jtag_proc_s jtag_proc;
+
+/* Half TCK period in CPU cycles, 0 runs as fast as the code allows */
+static uint32_t jtag_half;
+/* Cycles one bit takes at full speed, measured by jtagtap_init() */
+static uint32_t jtag_bit_cycles = 40;
+static uint32_t jtag_freq;
+
+#define JTAG_EDGE(t) do {					\
+	uint32_t _now;						\
+	while ((_now = platform_ccount()) - (t) < jtag_half)	\
+		;						\
+	(t) = _now;						\
+} while (0)
+
+#define TMS_SET(v) do {						\
+	if (v)							\
+		GPIO.out_w1ts = 1U << TMS_PIN;			\
+	else							\
+		GPIO.out_w1tc = 1U << TMS_PIN;			\
+} while (0)
+
+#define TDI_SET(v) do {						\
+	if (v)							\
+		GPIO.out_w1ts = 1U << TDI_PIN;			\
+	else							\
+		GPIO.out_w1tc = 1U << TDI_PIN;			\
+} while (0)
+
+#define TDO_READ()	((GPIO.in >> TDO_PIN) & 1U)
+
+/* TMS and TDI are sampled on the rising edge, TDO changes on the falling
+ * edge and is read while TCK is high */
+#define JTAG_BIT(t) do {					\
+	JTAG_EDGE(t);						\
+	GPIO.out_w1ts = 1U << TCK_PIN;				\
+	JTAG_EDGE(t);						\
+	GPIO.out_w1tc = 1U << TCK_PIN;				\
+} while (0)
+
+#define JTAG_TDI_TDO_BIT(t, out, in, n) do {			\
+	TDI_SET((in) & (1U << (n)));				\
+	JTAG_EDGE(t);						\
+	GPIO.out_w1ts = 1U << TCK_PIN;				\
+	(out) |= TDO_READ() << (n);				\
+	JTAG_EDGE(t);						\
+	GPIO.out_w1tc = 1U << TCK_PIN;				\
+} while (0)
+
+#define JTAG_TDI_BIT(t, in, n) do {				\
+	TDI_SET((in) & (1U << (n)));				\
+	JTAG_BIT(t);						\
+} while (0)
+
+#define JTAG_TDI_TDO4(t, out, in, n) \
+	JTAG_TDI_TDO_BIT(t, out, in, n); JTAG_TDI_TDO_BIT(t, out, in, (n) + 1); \
+	JTAG_TDI_TDO_BIT(t, out, in, (n) + 2); JTAG_TDI_TDO_BIT(t, out, in, (n) + 3)
+#define JTAG_TDI_TDO8(t, out, in, n)	JTAG_TDI_TDO4(t, out, in, n); JTAG_TDI_TDO4(t, out, in, (n) + 4)
+#define JTAG_TDI_TDO32(t, out, in) \
+	JTAG_TDI_TDO8(t, out, in, 0); JTAG_TDI_TDO8(t, out, in, 8); \
+	JTAG_TDI_TDO8(t, out, in, 16); JTAG_TDI_TDO8(t, out, in, 24)
+
+#define JTAG_TDI4(t, in, n) \
+	JTAG_TDI_BIT(t, in, n); JTAG_TDI_BIT(t, in, (n) + 1); \
+	JTAG_TDI_BIT(t, in, (n) + 2); JTAG_TDI_BIT(t, in, (n) + 3)
+#define JTAG_TDI8(t, in, n)	JTAG_TDI4(t, in, n); JTAG_TDI4(t, in, (n) + 4)
+#define JTAG_TDI32(t, in) \
+	JTAG_TDI8(t, in, 0); JTAG_TDI8(t, in, 8); JTAG_TDI8(t, in, 16); JTAG_TDI8(t, in, 24)
+
+static IRAM_ATTR bool jtagtap_next(const bool tms, const bool tdi)
+{
+	uint32_t t = platform_ccount();
+	uint32_t tdo = 0;
+
+	TMS_SET(tms);
+	JTAG_TDI_TDO_BIT(t, tdo, tdi ? 1U : 0U, 0);
+	return tdo;
+}
+
+static IRAM_ATTR void jtagtap_tms_seq(uint32_t tms_states, size_t clock_cycles)
+{
+	uint32_t t = platform_ccount();
+
+	TDI_SET(1);
+	for (size_t i = 0; i < clock_cycles; i++) {
+		TMS_SET(tms_states & 1U);
+		tms_states >>= 1U;
+		JTAG_BIT(t);
+	}
+}
+
+static void jtagtap_soft_reset(void)
+{
+	jtagtap_tms_seq(0x1fU, 6U);
+}
+
+static void jtagtap_reset(void)
+{
+	jtagtap_soft_reset();
+}
+
+/* Bits of a scan shifted as whole words, the last bit is always left for
+ * the tail so it can carry the final TMS */
+static inline size_t jtagtap_words(size_t clock_cycles)
+{
+	return clock_cycles ? (clock_cycles - 1U) / 32U : 0;
+}
+
+static IRAM_ATTR void jtagtap_tdi_tdo_seq(uint8_t *data_out, const bool final_tms, const uint8_t *data_in,
+	size_t clock_cycles)
+{
+	uint32_t t = platform_ccount();
+	const size_t words = jtagtap_words(clock_cycles);
+
+	TMS_SET(0);
+	for (size_t i = 0; i < words; i++) {
+		uint32_t in;
+		uint32_t out = 0;
+		memcpy(&in, data_in, 4);
+		JTAG_TDI_TDO32(t, out, in);
+		memcpy(data_out, &out, 4);
+		data_in += 4;
+		data_out += 4;
+	}
+
+	clock_cycles -= words * 32U;
+	uint8_t value = 0;
+	for (size_t cycle = 0; cycle < clock_cycles; cycle++) {
+		const size_t bit = cycle & 7U;
+		if (cycle + 1U == clock_cycles)
+			TMS_SET(final_tms);
+		JTAG_TDI_TDO_BIT(t, value, data_in[cycle >> 3U], bit);
+		if (bit == 7U) {
+			data_out[cycle >> 3U] = value;
+			value = 0;
+		}
+	}
+	if (clock_cycles & 7U)
+		data_out[clock_cycles >> 3U] = value;
+}
+
+static IRAM_ATTR void jtagtap_tdi_seq(const bool final_tms, const uint8_t *data_in, size_t clock_cycles)
+{
+	uint32_t t = platform_ccount();
+	const size_t words = jtagtap_words(clock_cycles);
+
+	TMS_SET(0);
+	for (size_t i = 0; i < words; i++) {
+		uint32_t in;
+		memcpy(&in, data_in, 4);
+		JTAG_TDI32(t, in);
+		data_in += 4;
+	}
+
+	clock_cycles -= words * 32U;
+	for (size_t cycle = 0; cycle < clock_cycles; cycle++) {
+		if (cycle + 1U == clock_cycles)
+			TMS_SET(final_tms);
+		JTAG_TDI_BIT(t, data_in[cycle >> 3U], cycle & 7U);
+	}
+}
+
+static IRAM_ATTR void jtagtap_cycle(const bool tms, const bool tdi, const size_t clock_cycles)
+{
+	uint32_t t = platform_ccount();
+
+	TMS_SET(tms);
+	TDI_SET(tdi);
+	for (size_t i = 0; i < clock_cycles; i++)
+		JTAG_BIT(t);
+}
+
+/* Sets the half period, never faster than the code itself can clock */
+void jtagtap_set_frequency(uint32_t freq)
+{
+	jtag_freq = freq;
+	uint32_t period = freq ? PLATFORM_CPU_HZ / freq : 0;
+	jtag_half = period > jtag_bit_cycles ? period / 2 : 0;
+}
+
+uint32_t jtagtap_get_frequency(void)
+{
+	uint32_t period = jtag_half * 2;
+	if (period < jtag_bit_cycles)
+		period = jtag_bit_cycles;
+	return PLATFORM_CPU_HZ / period;
+}
+
+void jtagtap_init(void)
+{
+	platform_jtag_active = true;
+	platform_target_clk_output_enable(true);
+	gpio_enable(TCK_PIN, GPIO_OUTPUT);
+	gpio_enable(TDI_PIN, GPIO_OUTPUT);
+	gpio_enable(TDO_PIN, GPIO_INPUT);
+	/* TMS shares the pin with SWDIO, which SWD may have left floating */
+	SWDIO_MODE_DRIVE();
+
+	jtag_proc.jtagtap_reset = jtagtap_reset;
+	jtag_proc.jtagtap_next = jtagtap_next;
+	jtag_proc.jtagtap_tms_seq = jtagtap_tms_seq;
+	jtag_proc.jtagtap_tdi_tdo_seq = jtagtap_tdi_tdo_seq;
+	jtag_proc.jtagtap_tdi_seq = jtagtap_tdi_seq;
+	jtag_proc.jtagtap_cycle = jtagtap_cycle;
+	jtag_proc.tap_idle_cycles = 1;
+
+	/* Time the first part of the SW-DP line reset at full speed, TMS high
+	 * only walks towards Test-Logic-Reset */
+	uint32_t half = jtag_half;
+	jtag_half = 0;
+	uint32_t start = platform_ccount();
+	jtagtap_tms_seq(0xffffffffU, 32U);
+	uint32_t cycles = (platform_ccount() - start) / 32;
+	if (cycles)
+		jtag_bit_cycles = cycles;
+	jtag_half = half;
+	if (jtag_freq)
+		jtagtap_set_frequency(jtag_freq);
+
+	/* Go to JTAG mode for SWJ-DP */
+	jtagtap_tms_seq(0xffffffffU, 19U);
+	jtagtap_tms_seq(0xe73cU, 16U);
+	jtagtap_soft_reset();
+}
@@ -62,25 +62,23 @@
 
 #include "ota-tftp.h"
 
-uint32_t swd_delay_cnt;
-#define SWD_CYCLES_PER_CLOCK 19L
-#define SWD_TOTAL_CYCLES 127L
-
 bool debug_bmp;
+bool platform_jtag_active;
+bool platform_frequency_user;
 
 void platform_max_frequency_set(uint32_t freq)
 {
 	if(freq < 50000) return;
-  int cnt = (160000000L - SWD_TOTAL_CYCLES*(int)freq)/(SWD_CYCLES_PER_CLOCK*(int)freq);
-  if(cnt < 0) cnt = 0;
-  swd_delay_cnt = cnt;
-  ESP_LOGI(__func__, "freq:%u set delay cycles: %d", freq, swd_delay_cnt);
+  platform_frequency_user = true;
+  swdptap_set_frequency(freq);
+  jtagtap_set_frequency(freq);
+  ESP_LOGI(__func__, "freq:%u SWD %u Hz, JTAG %u Hz", freq, swdptap_get_frequency(), jtagtap_get_frequency());
 
 }
 
 uint32_t platform_max_frequency_get(void)
 {
-	return 160000000 / (swd_delay_cnt*SWD_CYCLES_PER_CLOCK+SWD_TOTAL_CYCLES);
+	return platform_jtag_active ? jtagtap_get_frequency() : swdptap_get_frequency();
 }
 
 nvs_handle h_nvs_conf;
@@ -594,7 +592,12 @@ void app_main(void) {
   platform_init();
 
   xTaskCreate(&dbg_task, "dbg_main", 1024, NULL, 4, NULL);
+#ifdef CONFIG_GDB_SINGLE_TASK
+  /* Runs the packet handlers of every client */
+  xTaskCreate(&gdb_net_task, "gdb_net", 3500, NULL, 1, NULL);
+#else
   xTaskCreate(&gdb_net_task, "gdb_net", 2048, NULL, 1, NULL);
+#endif
 
 #if CONFIG_TARGET_UART
   xTaskCreate(&uart_rx_task, "uart_rx_task", 1200, NULL, 5, NULL);
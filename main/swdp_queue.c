@@ -0,0 +1,232 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Queued word transfers for the SW-DP memory access hooks.
+ *
+ * The generic ADIv5 code checks the ACK of every DP/AP access and may
+ * raise an exception on each one. For aligned word blocks this file
+ * instead streams the whole transfer: SELECT, CSW and TAR once per 1 KB
+ * auto-increment block, back to back DRW accesses with posted reads, and
+ * a single look at CTRL/STAT at the end. Overrun detection is enabled
+ * for the batch so a WAIT or FAULT keeps its data phase and the stream
+ * stays in step; the sticky flags then say whether anything went wrong.
+ * A failed batch is cleared with ABORT and redone through the original
+ * hooks, which report the error the usual way. A write is only redone
+ * from the first word not known to have landed.
+ *
+ * Only DPs found by the SWD scan are hooked, the stream is raw SWD.
+ */
+
+#include <string.h>
+
+#include "general.h"
+#include "sdkconfig.h"
+#include "swd.h"
+#include "target/adiv5.h"
+
+#ifdef CONFIG_SWD_QUEUE
+
+#define SWD_ACK_OK	1U
+/* Shorter transfers don't gain enough to pay for the batch setup */
+#define QUEUE_MIN_BYTES	16U
+/* Calls to leave to the original hooks after a batch failed */
+#define QUEUE_BACKOFF	32U
+
+/* Request and mode fields of CTRL/STAT, the rest is status */
+#define CTRLSTAT_RW	0x54ffff0dU
+
+static void (*dp_mem_read)(adiv5_access_port_s *ap, void *dest, target_addr_t src, size_t len);
+static void (*dp_mem_write)(adiv5_access_port_s *ap, target_addr_t dest, const void *src, size_t len,
+	align_e align);
+
+static bool queue_failed;
+/* Set once ORUNDETECT is on, WAIT and FAULT then keep their data phase */
+static bool queue_orun;
+static uint8_t queue_backoff;
+/* CTRL/STAT as found, put back at the end of the batch */
+static uint32_t queue_ctrlstat;
+
+static uint8_t swd_request(uint16_t addr, bool rnw)
+{
+	uint8_t request = 0x81U | ((addr & ADIV5_APnDP) ? 0x02U : 0U) | (rnw ? 0x04U : 0U) |
+		((addr & 0x0cU) << 1U);
+	if (__builtin_parity(request & 0x1eU))
+		request |= 0x20U;
+	return request;
+}
+
+static void queue_write(uint16_t addr, uint32_t value)
+{
+	swd_proc.seq_out(swd_request(addr, false), 8);
+	if (swd_proc.seq_in(3) != SWD_ACK_OK) {
+		queue_failed = true;
+		if (!queue_orun)
+			return;
+	}
+	swd_proc.seq_out_parity(value, 32);
+}
+
+static uint32_t queue_read(uint16_t addr)
+{
+	uint32_t value = 0;
+	swd_proc.seq_out(swd_request(addr, true), 8);
+	if (swd_proc.seq_in(3) != SWD_ACK_OK) {
+		queue_failed = true;
+		if (!queue_orun)
+			return 0;
+	}
+	if (swd_proc.seq_in_parity(&value, 32))
+		queue_failed = true;
+	return value;
+}
+
+static bool queue_begin(adiv5_access_port_s *ap)
+{
+	queue_failed = false;
+	queue_orun = false;
+	/* Each checked right away, until ORUNDETECT is on a WAIT has no data
+	 * phase. CTRL/STAT keeps whatever the DP layer set up. */
+	queue_write(ADIV5_DP_SELECT, (uint32_t)ap->apsel << 24U);
+	if (!queue_failed)
+		queue_ctrlstat = queue_read(ADIV5_DP_CTRLSTAT) & CTRLSTAT_RW;
+	if (!queue_failed)
+		queue_write(ADIV5_DP_CTRLSTAT, queue_ctrlstat | ADIV5_DP_CTRLSTAT_ORUNDETECT);
+	if (queue_failed) {
+		queue_backoff = QUEUE_BACKOFF;
+		return false;
+	}
+	queue_orun = true;
+	queue_write(ADIV5_AP_CSW, ap->csw | ADIV5_AP_CSW_SIZE_WORD | ADIV5_AP_CSW_ADDRINC_SINGLE);
+	return true;
+}
+
+static bool queue_end(void)
+{
+	const uint32_t ctrlstat = queue_read(ADIV5_DP_CTRLSTAT);
+	if (ctrlstat & (ADIV5_DP_CTRLSTAT_STICKYORUN | ADIV5_DP_CTRLSTAT_STICKYERR))
+		queue_failed = true;
+	if (queue_failed)
+		queue_write(ADIV5_DP_ABORT, ADIV5_DP_ABORT_ORUNERRCLR | ADIV5_DP_ABORT_WDERRCLR |
+			ADIV5_DP_ABORT_STKERRCLR | ADIV5_DP_ABORT_STKCMPCLR);
+	queue_write(ADIV5_DP_CTRLSTAT, queue_ctrlstat);
+	queue_orun = false;
+	/* Idle cycles so the last access completes before the clock stops */
+	swd_proc.seq_out(0, 8);
+	if (queue_failed)
+		queue_backoff = QUEUE_BACKOFF;
+	return !queue_failed;
+}
+
+/* Words left before TAR stops auto-incrementing */
+static size_t queue_block_words(target_addr_t addr, size_t words)
+{
+	const size_t n = (0x400U - (addr & 0x3ffU)) / 4U;
+	return n < words ? n : words;
+}
+
+static bool queue_mem_read_words(adiv5_access_port_s *ap, uint8_t *dest, target_addr_t src, size_t words)
+{
+	if (!queue_begin(ap))
+		return false;
+	while (words) {
+		const size_t n = queue_block_words(src, words);
+		queue_write(ADIV5_AP_TAR, src);
+		/* Each DRW read returns the previous one, RDBUFF the last */
+		queue_read(ADIV5_AP_DRW);
+		for (size_t i = 1; i < n; i++) {
+			const uint32_t value = queue_read(ADIV5_AP_DRW);
+			memcpy(dest, &value, 4);
+			dest += 4;
+		}
+		const uint32_t value = queue_read(ADIV5_DP_RDBUFF);
+		memcpy(dest, &value, 4);
+		dest += 4;
+		src += n * 4U;
+		words -= n;
+	}
+	return queue_end();
+}
+
+/* On failure *done is the number of leading words known to be written.
+ * An OK ACK means the AP finished the write before, the last write with
+ * an OK ACK of its own may still have faulted on the bus. */
+static bool queue_mem_write_words(adiv5_access_port_s *ap, target_addr_t dest, const uint8_t *src, size_t words,
+	size_t *done)
+{
+	size_t acked = 0;
+
+	*done = 0;
+	if (!queue_begin(ap))
+		return false;
+	while (words) {
+		const size_t n = queue_block_words(dest, words);
+		queue_write(ADIV5_AP_TAR, dest);
+		for (size_t i = 0; i < n; i++) {
+			uint32_t value;
+			memcpy(&value, src, 4);
+			queue_write(ADIV5_AP_DRW, value);
+			if (!queue_failed)
+				acked++;
+			src += 4;
+		}
+		dest += n * 4U;
+		words -= n;
+	}
+	if (queue_end())
+		return true;
+	*done = acked ? acked - 1U : 0;
+	return false;
+}
+
+static bool queue_usable(target_addr_t addr, size_t len)
+{
+	if ((addr & 3U) || (len & 3U) || len < QUEUE_MIN_BYTES)
+		return false;
+	if (queue_backoff) {
+		queue_backoff--;
+		return false;
+	}
+	return true;
+}
+
+static void queue_mem_read(adiv5_access_port_s *ap, void *dest, target_addr_t src, size_t len)
+{
+	if (!queue_usable(src, len) || !queue_mem_read_words(ap, dest, src, len / 4U))
+		dp_mem_read(ap, dest, src, len);
+}
+
+static void queue_mem_write(adiv5_access_port_s *ap, target_addr_t dest, const void *src, size_t len,
+	align_e align)
+{
+	size_t done = 0;
+
+	if (align != ALIGN_32BIT || !queue_usable(dest, len) || !queue_mem_write_words(ap, dest, src, len / 4U, &done))
+		dp_mem_write(ap, dest + done * 4U, (const uint8_t *)src + done * 4U, len - done * 4U, align);
+}
+
+void swdp_queue_attach(struct adiv5_debug_port *dp)
+{
+	/* A JTAG-DP from jtag_scan has its own low level access */
+	if (dp->low_access != firmware_swdp_low_access || dp->mem_read == queue_mem_read)
+		return;
+	dp_mem_read = dp->mem_read;
+	dp_mem_write = dp->mem_write;
+	dp->mem_read = queue_mem_read;
+	dp->mem_write = queue_mem_write;
+}
+
+#endif
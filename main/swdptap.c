@@ -0,0 +1,230 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* SW-DP bit engine for the ESP8266, replacing the common swdptap.c.
+ *
+ * Everything runs from IRAM so a transfer never waits on a flash cache
+ * miss. The sequences ADIv5 uses on every access (8 bit request, 3 bit
+ * ACK, 32 bit data with parity) are unrolled at compile time, other
+ * lengths take a plain loop. Clock edges are paced with the CCOUNT cycle
+ * counter: each edge waits until half a period has passed since the
+ * previous one, so the time spent in the code itself counts towards the
+ * period instead of being added to a fixed delay loop.
+ */
+
+#include "general.h"
+#include "platform.h"
+#include "swd.h"
+
+typedef enum {
+	SWDIO_STATUS_FLOAT = 0,
+	SWDIO_STATUS_DRIVE
+} swdio_status_t;
+
+swd_proc_s swd_proc;
+
+/* Half clock period in CPU cycles, 0 runs as fast as the code allows */
+static uint32_t swd_half;
+/* Cycles one bit takes at full speed, measured by swdptap_init() */
+static uint32_t swd_bit_cycles = 40;
+static uint32_t swd_freq;
+static swdio_status_t swd_dir = SWDIO_STATUS_FLOAT;
+
+#define SWD_EDGE(t) do {					\
+	uint32_t _now;						\
+	while ((_now = platform_ccount()) - (t) < swd_half)	\
+		;						\
+	(t) = _now;						\
+} while (0)
+
+#define SWCLK_HIGH()	(GPIO.out_w1ts = 1U << SWCLK_PIN)
+#define SWCLK_LOW()	(GPIO.out_w1tc = 1U << SWCLK_PIN)
+#define SWDIO_READ()	((GPIO.in >> SWDIO_PIN) & 1U)
+
+/* Host drives SWDIO while SWCLK is low, the target samples on the rising
+ * edge */
+#define SWD_OUT_BIT(t, bit) do {				\
+	if (bit)						\
+		GPIO.out_w1ts = 1U << SWDIO_PIN;		\
+	else							\
+		GPIO.out_w1tc = 1U << SWDIO_PIN;		\
+	SWD_EDGE(t);						\
+	SWCLK_HIGH();						\
+	SWD_EDGE(t);						\
+	SWCLK_LOW();						\
+} while (0)
+
+/* The target drives on the rising edge, the host samples before the next */
+#define SWD_IN_BIT(t, var, n) do {				\
+	SWD_EDGE(t);						\
+	(var) |= SWDIO_READ() << (n);				\
+	SWCLK_HIGH();						\
+	SWD_EDGE(t);						\
+	SWCLK_LOW();						\
+} while (0)
+
+#define SWD_OUT4(t, v, n) \
+	SWD_OUT_BIT(t, (v) & (1U << (n))); SWD_OUT_BIT(t, (v) & (1U << ((n) + 1))); \
+	SWD_OUT_BIT(t, (v) & (1U << ((n) + 2))); SWD_OUT_BIT(t, (v) & (1U << ((n) + 3)))
+#define SWD_OUT8(t, v, n)	SWD_OUT4(t, v, n); SWD_OUT4(t, v, (n) + 4)
+#define SWD_OUT32(t, v) \
+	SWD_OUT8(t, v, 0); SWD_OUT8(t, v, 8); SWD_OUT8(t, v, 16); SWD_OUT8(t, v, 24)
+
+#define SWD_IN4(t, var, n) \
+	SWD_IN_BIT(t, var, n); SWD_IN_BIT(t, var, (n) + 1); \
+	SWD_IN_BIT(t, var, (n) + 2); SWD_IN_BIT(t, var, (n) + 3)
+#define SWD_IN8(t, var, n)	SWD_IN4(t, var, n); SWD_IN4(t, var, (n) + 4)
+#define SWD_IN32(t, var) \
+	SWD_IN8(t, var, 0); SWD_IN8(t, var, 8); SWD_IN8(t, var, 16); SWD_IN8(t, var, 24)
+
+/* __builtin_parity() is a libgcc call on the lx106 and libgcc lives in
+ * flash, this stays in IRAM */
+static inline IRAM_ATTR uint32_t swdptap_parity(uint32_t v)
+{
+	v ^= v >> 16;
+	v ^= v >> 8;
+	v ^= v >> 4;
+	v ^= v >> 2;
+	v ^= v >> 1;
+	return v & 1U;
+}
+
+static IRAM_ATTR void swdptap_turnaround(swdio_status_t dir)
+{
+	if (dir == swd_dir)
+		return;
+	swd_dir = dir;
+
+	uint32_t t = platform_ccount();
+	if (dir == SWDIO_STATUS_FLOAT)
+		SWDIO_MODE_FLOAT();
+	SWD_EDGE(t);
+	SWCLK_HIGH();
+	SWD_EDGE(t);
+	SWCLK_LOW();
+	if (dir == SWDIO_STATUS_DRIVE)
+		SWDIO_MODE_DRIVE();
+}
+
+static IRAM_ATTR uint32_t swdptap_seq_in(size_t clock_cycles)
+{
+	uint32_t value = 0;
+
+	swdptap_turnaround(SWDIO_STATUS_FLOAT);
+	uint32_t t = platform_ccount();
+	switch (clock_cycles) {
+	case 3:		/* ACK */
+		SWD_IN_BIT(t, value, 0);
+		SWD_IN_BIT(t, value, 1);
+		SWD_IN_BIT(t, value, 2);
+		break;
+	case 32:
+		SWD_IN32(t, value);
+		break;
+	default:
+		for (size_t i = 0; i < clock_cycles; i++)
+			SWD_IN_BIT(t, value, i);
+	}
+	return value;
+}
+
+static IRAM_ATTR bool swdptap_seq_in_parity(uint32_t *ret, size_t clock_cycles)
+{
+	uint32_t value = 0;
+	uint32_t parity = 0;
+
+	swdptap_turnaround(SWDIO_STATUS_FLOAT);
+	uint32_t t = platform_ccount();
+	if (clock_cycles == 32) {
+		SWD_IN32(t, value);
+	} else {
+		for (size_t i = 0; i < clock_cycles; i++)
+			SWD_IN_BIT(t, value, i);
+	}
+	SWD_IN_BIT(t, parity, 0);
+	*ret = value;
+	/* True on a parity error */
+	return swdptap_parity(value) ^ parity;
+}
+
+static IRAM_ATTR void swdptap_seq_out(uint32_t tms_states, size_t clock_cycles)
+{
+	swdptap_turnaround(SWDIO_STATUS_DRIVE);
+	uint32_t t = platform_ccount();
+	switch (clock_cycles) {
+	case 8:		/* Request header */
+		SWD_OUT8(t, tms_states, 0);
+		break;
+	case 32:
+		SWD_OUT32(t, tms_states);
+		break;
+	default:
+		for (size_t i = 0; i < clock_cycles; i++)
+			SWD_OUT_BIT(t, tms_states & (1U << i));
+	}
+}
+
+static IRAM_ATTR void swdptap_seq_out_parity(uint32_t tms_states, size_t clock_cycles)
+{
+	swdptap_turnaround(SWDIO_STATUS_DRIVE);
+	uint32_t t = platform_ccount();
+	if (clock_cycles == 32) {
+		SWD_OUT32(t, tms_states);
+	} else {
+		for (size_t i = 0; i < clock_cycles; i++)
+			SWD_OUT_BIT(t, tms_states & (1U << i));
+	}
+	SWD_OUT_BIT(t, swdptap_parity(tms_states));
+}
+
+/* Sets the half period, never faster than the code itself can clock */
+void swdptap_set_frequency(uint32_t freq)
+{
+	swd_freq = freq;
+	uint32_t period = freq ? PLATFORM_CPU_HZ / freq : 0;
+	swd_half = period > swd_bit_cycles ? period / 2 : 0;
+}
+
+uint32_t swdptap_get_frequency(void)
+{
+	uint32_t period = swd_half * 2;
+	if (period < swd_bit_cycles)
+		period = swd_bit_cycles;
+	return PLATFORM_CPU_HZ / period;
+}
+
+void swdptap_init(void)
+{
+	platform_jtag_active = false;
+	swd_proc.seq_in = swdptap_seq_in;
+	swd_proc.seq_in_parity = swdptap_seq_in_parity;
+	swd_proc.seq_out = swdptap_seq_out;
+	swd_proc.seq_out_parity = swdptap_seq_out_parity;
+
+	/* Time a full speed read, it clocks the line like the idle cycles
+	 * ahead of the scan's line reset */
+	uint32_t half = swd_half;
+	swd_half = 0;
+	uint32_t start = platform_ccount();
+	swdptap_seq_in(32);
+	uint32_t cycles = (platform_ccount() - start) / 32;
+	if (cycles)
+		swd_bit_cycles = cycles;
+	swd_half = half;
+	if (swd_freq)
+		swdptap_set_frequency(swd_freq);
+}
@@ -0,0 +1,24 @@
+#pragma once
+#include <chrono>
+#include <stdio.h>
+
+/* Runs fn until at least 200 ms have passed and prints the throughput of
+ * bytes processed per call */
+template <typename Fn>
+double bench_mbps(const char *name, size_t bytes, Fn fn)
+{
+	using clock = std::chrono::steady_clock;
+	size_t calls = 0;
+	const auto start = clock::now();
+	auto now = start;
+	do {
+		for (int i = 0; i < 64; i++)
+			fn();
+		calls += 64;
+		now = clock::now();
+	} while (now - start < std::chrono::milliseconds(200));
+	const double secs = std::chrono::duration<double>(now - start).count();
+	const double mbps = calls * bytes / secs / 1e6;
+	printf("%-24s %8.1f MB/s\n", name, mbps);
+	return mbps;
+}
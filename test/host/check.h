@@ -0,0 +1,21 @@
+#pragma once
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Fails the test in any build type, unlike assert() */
+#define CHECK(cond) do {						\
+	if (!(cond)) {							\
+		fprintf(stderr, "%s:%d: CHECK(%s) failed\n",		\
+			__FILE__, __LINE__, #cond);			\
+		exit(1);						\
+	}								\
+} while (0)
+
+#define CHECK_EQ(a, b) do {						\
+	unsigned long long _a = (a), _b = (b);				\
+	if (_a != _b) {							\
+		fprintf(stderr, "%s:%d: CHECK_EQ(%s, %s) failed: 0x%llx != 0x%llx\n", \
+			__FILE__, __LINE__, #a, #b, _a, _b);		\
+		exit(1);						\
+	}								\
+} while (0)
@@ -0,0 +1,8 @@
+#pragma once
+#include <stdint.h>
+
+#define EXCEPTION_ERROR		0x01
+#define EXCEPTION_TIMEOUT	0x02
+#define EXCEPTION_ALL		-1
+
+void raise_exception(uint32_t type, const char *msg);
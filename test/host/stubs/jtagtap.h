@@ -0,0 +1,20 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct jtag_proc {
+	void (*jtagtap_reset)(void);
+	bool (*jtagtap_next)(const bool tms, const bool tdi);
+	void (*jtagtap_tms_seq)(uint32_t tms_states, size_t clock_cycles);
+	void (*jtagtap_tdi_tdo_seq)(uint8_t *data_out, const bool final_tms, const uint8_t *data_in,
+		size_t clock_cycles);
+	void (*jtagtap_tdi_seq)(const bool final_tms, const uint8_t *data_in, size_t clock_cycles);
+	void (*jtagtap_cycle)(const bool tms, const bool tdi, const size_t clock_cycles);
+	uint8_t tap_idle_cycles;
+} jtag_proc_s;
+
+extern jtag_proc_s jtag_proc;
+
+void jtagtap_init(void);
+void platform_target_clk_output_enable(bool enable);
@@ -0,0 +1,65 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "sdkconfig.h"
+
+#define PLATFORM_CPU_HZ	(CONFIG_ESP8266_DEFAULT_CPU_FREQ_MHZ * 1000000U)
+
+#define IRAM_ATTR
+
+#define SWDIO_PIN	2
+#define SWCLK_PIN	0
+#define TMS_PIN		SWDIO_PIN
+#define TCK_PIN		SWCLK_PIN
+#define TDI_PIN		12
+#define TDO_PIN		13
+
+#define GPIO_INPUT	0
+#define GPIO_OUTPUT	1
+
+extern bool platform_jtag_active;
+
+void swdptap_set_frequency(uint32_t freq);
+uint32_t swdptap_get_frequency(void);
+void jtagtap_set_frequency(uint32_t freq);
+uint32_t jtagtap_get_frequency(void);
+
+#ifdef __cplusplus
+extern "C++" {
+/* GPIO registers of the host build. The bit engines are compiled as C++
+ * so that every register access reaches the test's pin model through
+ * host_gpio_write()/host_gpio_read(), and CCOUNT is the test's clock. */
+enum host_gpio_reg {
+	HOST_OUT_W1TS, HOST_OUT_W1TC, HOST_ENABLE_W1TS, HOST_ENABLE_W1TC
+};
+
+void host_gpio_write(host_gpio_reg reg, uint32_t value);
+uint32_t host_gpio_read(void);
+uint32_t platform_ccount(void);
+
+template <host_gpio_reg reg>
+struct host_gpio_wo {
+	void operator=(uint32_t value) { host_gpio_write(reg, value); }
+};
+
+struct host_gpio_in {
+	operator uint32_t() const { return host_gpio_read(); }
+};
+
+struct host_gpio_s {
+	host_gpio_wo<HOST_OUT_W1TS> out_w1ts;
+	host_gpio_wo<HOST_OUT_W1TC> out_w1tc;
+	host_gpio_wo<HOST_ENABLE_W1TS> enable_w1ts;
+	host_gpio_wo<HOST_ENABLE_W1TC> enable_w1tc;
+	host_gpio_in in;
+};
+
+extern host_gpio_s GPIO;
+}
+
+#define gpio_enable(pin, mode) \
+	host_gpio_write((mode) == GPIO_OUTPUT ? HOST_ENABLE_W1TS : HOST_ENABLE_W1TC, 1U << (pin))
+#define SWDIO_MODE_FLOAT()	GPIO.enable_w1tc = (0x1 << SWDIO_PIN);
+#define SWDIO_MODE_DRIVE()	GPIO.enable_w1ts = (0x1 << SWDIO_PIN);
+#endif
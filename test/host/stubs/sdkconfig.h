@@ -0,0 +1,3 @@
+#pragma once
+/* Host build: only what the sources under test read */
+#define CONFIG_ESP8266_DEFAULT_CPU_FREQ_MHZ 160
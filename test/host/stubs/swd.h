@@ -0,0 +1,15 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct swd_proc {
+	uint32_t (*seq_in)(size_t clock_cycles);
+	bool (*seq_in_parity)(uint32_t *ret, size_t clock_cycles);
+	void (*seq_out)(uint32_t tms_states, size_t clock_cycles);
+	void (*seq_out_parity)(uint32_t tms_states, size_t clock_cycles);
+} swd_proc_s;
+
+extern swd_proc_s swd_proc;
+
+void swdptap_init(void);
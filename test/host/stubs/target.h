@@ -0,0 +1,11 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct target_s target_s;
+typedef target_s target;
+typedef uint32_t target_addr_t;
+
+/* Nonzero on error, as in the firmware */
+int target_mem_read(target *t, void *dest, target_addr_t src, size_t len);
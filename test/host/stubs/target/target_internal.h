@@ -0,0 +1,6 @@
+#pragma once
+#include "target.h"
+
+struct target_s {
+	void *priv;
+};
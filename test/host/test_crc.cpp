@@ -0,0 +1,140 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "check.h"
+#include "bench.h"
+#include "gdb_crc.hpp"
+
+extern "C" {
+#include "target/target_internal.h"
+}
+
+/* One bit at a time, MSB first, as the qCRC specification states it */
+static uint32_t ref_crc32(uint32_t crc, const void *buf, size_t len)
+{
+	const uint8_t *p = (const uint8_t *)buf;
+	while (len--) {
+		crc ^= (uint32_t)*p++ << 24;
+		for (int i = 0; i < 8; i++)
+			crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04c11db7 : crc << 1;
+	}
+	return crc;
+}
+
+static uint32_t rng = 0x2545f491;
+
+static uint32_t next_rand()
+{
+	rng ^= rng << 13;
+	rng ^= rng >> 17;
+	rng ^= rng << 5;
+	return rng;
+}
+
+static uint8_t image[64 * 1024];
+
+static void fill_image()
+{
+	for (size_t i = 0; i < sizeof(image); i++)
+		image[i] = next_rand();
+}
+
+static void test_reference()
+{
+	/* CRC-32/MPEG-2 check value, the same parameters GDB uses */
+	CHECK_EQ(gdb_crc32(0xffffffff, "123456789", 9), 0x0376e6e7);
+	CHECK_EQ(ref_crc32(0xffffffff, "123456789", 9), 0x0376e6e7);
+	CHECK_EQ(gdb_crc32(0xffffffff, "", 0), 0xffffffff);
+
+	/* Every alignment of the word loop and every tail length */
+	for (size_t align = 0; align < 8; align++) {
+		for (size_t len = 0; len < 300; len++) {
+			const uint8_t *p = image + next_rand() % 4096 * 8 + align;
+			uint32_t seed = next_rand();
+			CHECK_EQ(gdb_crc32(seed, p, len), ref_crc32(seed, p, len));
+		}
+	}
+	for (int i = 0; i < 50; i++) {
+		size_t off = next_rand() % (sizeof(image) / 2);
+		size_t len = next_rand() % (sizeof(image) / 2);
+		CHECK_EQ(gdb_crc32(0xffffffff, image + off, len), ref_crc32(0xffffffff, image + off, len));
+	}
+
+	/* Chained calls equal one call over the whole range */
+	uint32_t whole = gdb_crc32(0xffffffff, image, 10000);
+	uint32_t parts = 0xffffffff;
+	for (size_t off = 0; off < 10000; ) {
+		size_t n = next_rand() % 97;
+		if (n > 10000 - off)
+			n = 10000 - off;
+		parts = gdb_crc32(parts, image + off, n);
+		off += n;
+	}
+	CHECK_EQ(parts, whole);
+}
+
+/* Target memory backed by image at FLASH_BASE */
+#define FLASH_BASE 0x08000000U
+
+static size_t reads;
+static target_addr_t fail_addr;
+
+extern "C" int target_mem_read(target *t, void *dest, target_addr_t src, size_t len)
+{
+	(void)t;
+	reads++;
+	CHECK(src >= FLASH_BASE && src + len <= FLASH_BASE + sizeof(image));
+	/* Reads are whole aligned blocks where the range allows */
+	CHECK(len <= 1024);
+	CHECK((src & 1023) + len <= 1024);
+	if (fail_addr >= src && fail_addr < src + len)
+		return 1;
+	memcpy(dest, image + (src - FLASH_BASE), len);
+	return 0;
+}
+
+static void test_target()
+{
+	target t = {};
+	uint32_t crc;
+
+	reads = 0;
+	CHECK(gdb_target_crc32(&t, &crc, FLASH_BASE, sizeof(image)));
+	CHECK_EQ(crc, ref_crc32(0xffffffff, image, sizeof(image)));
+	CHECK_EQ(reads, sizeof(image) / 1024);
+
+	/* Unaligned start and end, first and last blocks are partial */
+	reads = 0;
+	CHECK(gdb_target_crc32(&t, &crc, FLASH_BASE + 1001, 5000));
+	CHECK_EQ(crc, ref_crc32(0xffffffff, image + 1001, 5000));
+	CHECK_EQ(reads, 6);
+
+	CHECK(gdb_target_crc32(&t, &crc, FLASH_BASE + 77, 0));
+	CHECK_EQ(crc, 0xffffffff);
+
+	/* A failed read fails the whole CRC and leaves *crc alone */
+	fail_addr = FLASH_BASE + 3000;
+	crc = 0x12345678;
+	CHECK(!gdb_target_crc32(&t, &crc, FLASH_BASE, 8192));
+	CHECK_EQ(crc, 0x12345678);
+	fail_addr = 0;
+}
+
+/* compare-sections over a 64 KB image */
+static void bench()
+{
+	volatile uint32_t sink;
+
+	bench_mbps("crc32 bitwise", sizeof(image), [&] { sink = ref_crc32(0xffffffff, image, sizeof(image)); });
+	bench_mbps("gdb_crc32 slice-by-8", sizeof(image), [&] { sink = gdb_crc32(0xffffffff, image, sizeof(image)); });
+	(void)sink;
+}
+
+int main()
+{
+	fill_image();
+	test_reference();
+	test_target();
+	bench();
+	return 0;
+}
@@ -0,0 +1,156 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "check.h"
+#include "bench.h"
+#include "gdb_hex.hpp"
+
+/* Nibble at a time, as hexify()/unhexify() in hex_utils.c */
+static const char ref_digits[] = "0123456789abcdef";
+
+static char *ref_hexify(char *hex, const void *buf, size_t size)
+{
+	const uint8_t *src = (const uint8_t *)buf;
+	char *dst = hex;
+	for (size_t i = 0; i < size; i++) {
+		*dst++ = ref_digits[src[i] >> 4];
+		*dst++ = ref_digits[src[i] & 0xf];
+	}
+	*dst = 0;
+	return hex;
+}
+
+static uint8_t ref_unhex_digit(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return c - 'A' + 10;
+}
+
+static char *ref_unhexify(void *buf, const char *hex, size_t size)
+{
+	uint8_t *dst = (uint8_t *)buf;
+	for (size_t i = 0; i < size; i++, hex += 2)
+		dst[i] = (ref_unhex_digit(hex[0]) << 4) | ref_unhex_digit(hex[1]);
+	return (char *)buf;
+}
+
+static uint32_t rng = 0x12345678;
+
+static uint32_t next_rand()
+{
+	rng ^= rng << 13;
+	rng ^= rng >> 17;
+	rng ^= rng << 5;
+	return rng;
+}
+
+/* Every length and source alignment of the word loop, both directions */
+static void test_codec()
+{
+	uint8_t data[80];
+	char hex[2 * sizeof(data) + 1];
+	char ref[2 * sizeof(data) + 1];
+	uint8_t back[sizeof(data)];
+
+	for (size_t align = 0; align < 4; align++) {
+		for (size_t len = 0; len + align <= sizeof(data); len++) {
+			for (size_t i = 0; i < sizeof(data); i++)
+				data[i] = next_rand();
+			CHECK(gdb_hexify(hex, data + align, len) == hex);
+			ref_hexify(ref, data + align, len);
+			CHECK(!strcmp(hex, ref));
+
+			memset(back, 0, sizeof(back));
+			gdb_unhexify(back, hex, len);
+			CHECK(!memcmp(back, data + align, len));
+		}
+	}
+
+	/* Upper case digits as some clients send them */
+	gdb_unhexify(back, "DEADbeef0A", 5);
+	CHECK_EQ(back[0], 0xde);
+	CHECK_EQ(back[1], 0xad);
+	CHECK_EQ(back[2], 0xbe);
+	CHECK_EQ(back[3], 0xef);
+	CHECK_EQ(back[4], 0x0a);
+}
+
+/* m replies hexify from the upper half of the buffer into the lower */
+static void test_in_place()
+{
+	for (size_t len = 1; len <= 64; len++) {
+		char buf[2 * 64 + 1];
+		uint8_t data[64];
+		char ref[2 * 64 + 1];
+		for (size_t i = 0; i < len; i++)
+			data[i] = next_rand();
+		memcpy(buf + len, data, len);
+		gdb_hexify(buf, buf + len, len);
+		ref_hexify(ref, data, len);
+		CHECK(!strcmp(buf, ref));
+	}
+}
+
+static void test_parse()
+{
+	const char *p = "1fA0,x";
+	CHECK_EQ(gdb_hex_parse(&p), 0x1fa0);
+	CHECK(*p == ',');
+
+	uint32_t addr, len;
+	const char *rest = gdb_hex_addr_len("20000000,400:", &addr, &len);
+	CHECK(rest && *rest == ':');
+	CHECK_EQ(addr, 0x20000000);
+	CHECK_EQ(len, 0x400);
+	CHECK(!gdb_hex_addr_len(",400", &addr, &len));
+	CHECK(!gdb_hex_addr_len("100,", &addr, &len));
+	CHECK(!gdb_hex_addr_len("100", &addr, &len));
+
+	CHECK_EQ(gdb_unhex_digit('7'), 7);
+	CHECK_EQ(gdb_unhex_digit('F'), 15);
+	CHECK(gdb_unhex_digit('g') < 0);
+	CHECK(gdb_unhex_digit('#') < 0);
+
+	char hex[9];
+	CHECK_EQ(gdb_hex_u32(hex, 0), 1);
+	CHECK(!strcmp(hex, "0"));
+	CHECK_EQ(gdb_hex_u32(hex, 0xabc), 3);
+	CHECK(!strcmp(hex, "abc"));
+	CHECK_EQ(gdb_hex_u32(hex, 0xffffffff), 8);
+	CHECK(!strcmp(hex, "ffffffff"));
+	for (int i = 0; i < 1000; i++) {
+		uint32_t v = next_rand() >> (next_rand() % 32);
+		char ref[9];
+		snprintf(ref, sizeof(ref), "%x", v);
+		gdb_hex_u32(hex, v);
+		CHECK(!strcmp(hex, ref));
+	}
+}
+
+/* A g reply or a 1 KB memory read */
+static void bench()
+{
+	static uint8_t data[1024];
+	static char hex[2 * sizeof(data) + 1];
+	volatile char sink;
+
+	for (size_t i = 0; i < sizeof(data); i++)
+		data[i] = next_rand();
+	bench_mbps("hexify reference", sizeof(data), [&] { ref_hexify(hex, data, sizeof(data)); sink = hex[7]; });
+	bench_mbps("gdb_hexify", sizeof(data), [&] { gdb_hexify(hex, data, sizeof(data)); sink = hex[7]; });
+	bench_mbps("unhexify reference", sizeof(data), [&] { ref_unhexify(data, hex, sizeof(data)); sink = data[7]; });
+	bench_mbps("gdb_unhexify", sizeof(data), [&] { gdb_unhexify(data, hex, sizeof(data)); sink = data[7]; });
+	(void)sink;
+}
+
+int main()
+{
+	test_codec();
+	test_in_place();
+	test_parse();
+	bench();
+	return 0;
+}
@@ -0,0 +1,388 @@
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+#include "check.h"
+#include "general.h"
+#include "jtagtap.h"
+
+host_gpio_s GPIO;
+bool platform_jtag_active;
+static bool clk_output;
+
+void platform_target_clk_output_enable(bool enable)
+{
+	clk_output = enable;
+}
+
+/* CCOUNT advances one tick per read, so pacing loops terminate */
+static uint32_t ccount;
+
+uint32_t platform_ccount(void)
+{
+	return ++ccount;
+}
+
+/* IEEE 1149.1 TAP controller with a 4 bit IR. Capture and shift happen
+ * on the rising edge of TCK, update and TDO changes on the falling one.
+ */
+enum tap_state {
+	TLR, RTI, SEL_DR, CAP_DR, SHIFT_DR, EXIT1_DR, PAUSE_DR, EXIT2_DR, UPD_DR,
+	SEL_IR, CAP_IR, SHIFT_IR, EXIT1_IR, PAUSE_IR, EXIT2_IR, UPD_IR,
+};
+
+/* Next state for TMS low and high */
+static const tap_state tap_next[16][2] = {
+	[TLR] = { RTI, TLR },
+	[RTI] = { RTI, SEL_DR },
+	[SEL_DR] = { CAP_DR, SEL_IR },
+	[CAP_DR] = { SHIFT_DR, EXIT1_DR },
+	[SHIFT_DR] = { SHIFT_DR, EXIT1_DR },
+	[EXIT1_DR] = { PAUSE_DR, UPD_DR },
+	[PAUSE_DR] = { PAUSE_DR, EXIT2_DR },
+	[EXIT2_DR] = { SHIFT_DR, UPD_DR },
+	[UPD_DR] = { RTI, SEL_DR },
+	[SEL_IR] = { CAP_IR, TLR },
+	[CAP_IR] = { SHIFT_IR, EXIT1_IR },
+	[SHIFT_IR] = { SHIFT_IR, EXIT1_IR },
+	[EXIT1_IR] = { PAUSE_IR, UPD_IR },
+	[PAUSE_IR] = { PAUSE_IR, EXIT2_IR },
+	[EXIT2_IR] = { SHIFT_IR, UPD_IR },
+	[UPD_IR] = { RTI, SEL_DR },
+};
+
+#define IR_LEN		4
+#define IR_TEST		0x5
+#define IR_IDCODE	0xe
+#define IR_BYPASS	0xf
+#define IDCODE		0x4ba00477U
+#define TEST_LEN	77
+
+static struct {
+	tap_state state;
+	uint32_t out, enable;
+	bool tdo;
+	uint8_t ir;
+	std::vector<bool> shift;
+	std::vector<bool> test_reg;
+	unsigned rti_cycles;
+	unsigned undriven;
+	unsigned rises;
+	uint32_t last_rise;
+	uint32_t min_period;
+} tap;
+
+static void capture_dr()
+{
+	tap.shift.clear();
+	switch (tap.ir) {
+	case IR_IDCODE:
+		for (int i = 0; i < 32; i++)
+			tap.shift.push_back((IDCODE >> i) & 1);
+		break;
+	case IR_TEST:
+		tap.shift = tap.test_reg;
+		break;
+	default:
+		/* BYPASS and anything unknown */
+		tap.shift.push_back(false);
+	}
+}
+
+static void capture_ir()
+{
+	tap.shift.assign(IR_LEN, false);
+	tap.shift[0] = true;
+}
+
+static void shift_in(bool tdi)
+{
+	tap.shift.erase(tap.shift.begin());
+	tap.shift.push_back(tdi);
+}
+
+static void tap_rise()
+{
+	const bool tms = (tap.out >> TMS_PIN) & 1U;
+	const bool tdi = (tap.out >> TDI_PIN) & 1U;
+	const uint32_t driven = (1U << TMS_PIN) | (1U << TDI_PIN) | (1U << TCK_PIN);
+
+	if ((tap.enable & driven) != driven)
+		tap.undriven++;
+	if (tap.rises++ && ccount - tap.last_rise < tap.min_period)
+		tap.min_period = ccount - tap.last_rise;
+	tap.last_rise = ccount;
+
+	switch (tap.state) {
+	case CAP_DR:
+		capture_dr();
+		break;
+	case CAP_IR:
+		capture_ir();
+		break;
+	case SHIFT_DR:
+	case SHIFT_IR:
+		shift_in(tdi);
+		break;
+	case RTI:
+		tap.rti_cycles++;
+		break;
+	default:
+		break;
+	}
+	tap.state = tap_next[tap.state][tms];
+}
+
+static void tap_fall()
+{
+	switch (tap.state) {
+	case TLR:
+		tap.ir = IR_IDCODE;
+		break;
+	case SHIFT_DR:
+	case SHIFT_IR:
+		tap.tdo = tap.shift[0];
+		break;
+	case UPD_DR:
+		if (tap.ir == IR_TEST)
+			tap.test_reg = tap.shift;
+		break;
+	case UPD_IR: {
+		uint8_t ir = 0;
+		for (int i = 0; i < IR_LEN; i++)
+			ir |= tap.shift[i] << i;
+		tap.ir = ir;
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+void host_gpio_write(host_gpio_reg reg, uint32_t value)
+{
+	const uint32_t out = tap.out;
+	switch (reg) {
+	case HOST_OUT_W1TS:
+		tap.out |= value;
+		break;
+	case HOST_OUT_W1TC:
+		tap.out &= ~value;
+		break;
+	case HOST_ENABLE_W1TS:
+		tap.enable |= value;
+		break;
+	case HOST_ENABLE_W1TC:
+		tap.enable &= ~value;
+		break;
+	}
+	const uint32_t tck = 1U << TCK_PIN;
+	if (!(out & tck) && (tap.out & tck))
+		tap_rise();
+	else if ((out & tck) && !(tap.out & tck))
+		tap_fall();
+}
+
+uint32_t host_gpio_read(void)
+{
+	return (tap.out & ~(1U << TDO_PIN)) | ((uint32_t)tap.tdo << TDO_PIN);
+}
+
+static uint32_t rng = 0x6b43a9b5;
+
+static uint32_t next_rand()
+{
+	rng ^= rng << 13;
+	rng ^= rng >> 17;
+	rng ^= rng << 5;
+	return rng;
+}
+
+/* From Run-Test/Idle and back, the way jtag_scan shifts IR and DR */
+static uint8_t shift_ir(uint8_t ir)
+{
+	uint8_t out = 0;
+	jtag_proc.jtagtap_tms_seq(0x3, 4);
+	CHECK(tap.state == SHIFT_IR);
+	jtag_proc.jtagtap_tdi_tdo_seq(&out, true, &ir, IR_LEN);
+	CHECK(tap.state == EXIT1_IR);
+	jtag_proc.jtagtap_tms_seq(0x1, 2);
+	CHECK(tap.state == RTI);
+	return out;
+}
+
+static void shift_dr(uint8_t *out, const uint8_t *in, size_t bits)
+{
+	jtag_proc.jtagtap_tms_seq(0x1, 3);
+	CHECK(tap.state == SHIFT_DR);
+	if (out)
+		jtag_proc.jtagtap_tdi_tdo_seq(out, true, in, bits);
+	else
+		jtag_proc.jtagtap_tdi_seq(true, in, bits);
+	CHECK(tap.state == EXIT1_DR);
+	jtag_proc.jtagtap_tms_seq(0x1, 2);
+	CHECK(tap.state == RTI);
+}
+
+static bool get_bit(const uint8_t *buf, size_t i)
+{
+	return (buf[i / 8] >> (i % 8)) & 1;
+}
+
+static void test_init()
+{
+	tap.out = 0;
+	tap.state = SHIFT_DR;
+	tap.shift.assign(8, false);
+	tap.test_reg.assign(TEST_LEN, false);
+	tap.min_period = UINT32_MAX;
+
+	jtagtap_init();
+	CHECK(platform_jtag_active);
+	CHECK(clk_output);
+	/* Five TMS highs reach Test-Logic-Reset, the last low parks in
+	 * Run-Test/Idle */
+	CHECK(tap.state == RTI);
+	CHECK_EQ(tap.ir, IR_IDCODE);
+	CHECK_EQ(tap.undriven, 0);
+
+	CHECK(!jtag_proc.jtagtap_next(false, true));
+	CHECK(tap.state == RTI);
+}
+
+static void test_idcode_bypass()
+{
+	uint8_t out[8] = {};
+	uint8_t in[8] = {};
+
+	/* Capture-IR loads 0b01 */
+	CHECK_EQ(shift_ir(IR_IDCODE), 0x1);
+	shift_dr(out, in, 32);
+	uint32_t id;
+	memcpy(&id, out, 4);
+	CHECK_EQ(id, IDCODE);
+
+	/* One bit of delay, the captured 0 comes first */
+	CHECK_EQ(shift_ir(IR_BYPASS), 0x1);
+	for (size_t i = 0; i < sizeof(in); i++)
+		in[i] = next_rand();
+	shift_dr(out, in, 64);
+	CHECK(!get_bit(out, 0));
+	for (size_t i = 1; i < 64; i++)
+		CHECK_EQ(get_bit(out, i), get_bit(in, i - 1));
+}
+
+/* Every length around the word boundaries through a 77 bit register:
+ * the old contents come out first, then the bits shifted in */
+static void test_lengths()
+{
+	const size_t lengths[] = { 1, 2, 7, 8, 9, 31, 32, 33, 63, 64, 65, 77, 96, 97, 128, 200 };
+	uint8_t in[32];
+	uint8_t out[32 + 8];
+
+	CHECK_EQ(shift_ir(IR_TEST), 0x1);
+	for (size_t bits : lengths) {
+		for (size_t i = 0; i < sizeof(in); i++)
+			in[i] = next_rand();
+		std::vector<bool> expect = tap.test_reg;
+		for (size_t i = 0; i < bits; i++)
+			expect.push_back(get_bit(in, i));
+
+		/* Nothing past the last byte of the scan is written */
+		memset(out, 0xaa, sizeof(out));
+		shift_dr(out, in, bits);
+		for (size_t i = 0; i < bits; i++)
+			CHECK_EQ(get_bit(out, i), expect[i]);
+		for (size_t i = (bits + 7) / 8; i < sizeof(out); i++)
+			CHECK_EQ(out[i], 0xaa);
+		CHECK(tap.test_reg == std::vector<bool>(expect.begin() + bits, expect.end()));
+
+		/* The same without reading TDO */
+		expect = tap.test_reg;
+		for (size_t i = 0; i < bits; i++)
+			expect.push_back(get_bit(in, i) ^ 1);
+		for (size_t i = 0; i < sizeof(in); i++)
+			in[i] = ~in[i];
+		shift_dr(nullptr, in, bits);
+		CHECK(tap.test_reg == std::vector<bool>(expect.begin() + bits, expect.end()));
+	}
+	CHECK_EQ(tap.undriven, 0);
+}
+
+/* A scan split in two, the first part must leave TMS low */
+static void test_split_scan()
+{
+	uint8_t in[10], out1[8], out2[8];
+	for (size_t i = 0; i < sizeof(in); i++)
+		in[i] = next_rand();
+	const std::vector<bool> old = tap.test_reg;
+
+	jtag_proc.jtagtap_tms_seq(0x1, 3);
+	jtag_proc.jtagtap_tdi_tdo_seq(out1, false, in, 40);
+	CHECK(tap.state == SHIFT_DR);
+	jtag_proc.jtagtap_tdi_tdo_seq(out2, true, in + 5, TEST_LEN - 40);
+	CHECK(tap.state == EXIT1_DR);
+	jtag_proc.jtagtap_tms_seq(0x1, 2);
+
+	for (size_t i = 0; i < 40; i++)
+		CHECK_EQ(get_bit(out1, i), old[i]);
+	for (size_t i = 40; i < TEST_LEN; i++)
+		CHECK_EQ(get_bit(out2, i - 40), old[i]);
+	for (size_t i = 0; i < TEST_LEN; i++)
+		CHECK_EQ(tap.test_reg[i], get_bit(in, i));
+}
+
+static void test_cycles_reset()
+{
+	const unsigned before = tap.rti_cycles;
+	jtag_proc.jtagtap_cycle(false, false, 10);
+	CHECK(tap.state == RTI);
+	CHECK_EQ(tap.rti_cycles - before, 10);
+
+	CHECK_EQ(shift_ir(IR_BYPASS), 0x1);
+	jtag_proc.jtagtap_reset();
+	CHECK(tap.state == RTI);
+	CHECK_EQ(tap.ir, IR_IDCODE);
+
+	/* jtagtap_next returns TDO as it was during the cycle */
+	jtag_proc.jtagtap_tms_seq(0x1, 3);
+	for (int i = 0; i < 32; i++)
+		CHECK_EQ(jtag_proc.jtagtap_next(i == 31, false), (IDCODE >> i) & 1);
+	CHECK(tap.state == EXIT1_DR);
+	jtag_proc.jtagtap_tms_seq(0x1, 2);
+	CHECK(tap.state == RTI);
+}
+
+/* Rising edges are at least a full period apart at any requested clock */
+static void test_frequency()
+{
+	jtagtap_set_frequency(1000000);
+	CHECK_EQ(jtagtap_get_frequency(), 1000000);
+
+	const uint32_t freqs[] = { 100000, 1000000, 3000000, 7000000 };
+	uint8_t in[12] = {}, out[12];
+	for (uint32_t freq : freqs) {
+		jtagtap_set_frequency(freq);
+		const uint32_t half = PLATFORM_CPU_HZ / freq / 2;
+		CHECK(jtagtap_get_frequency() >= freq);
+
+		tap.rises = 0;
+		tap.min_period = UINT32_MAX;
+		CHECK_EQ(shift_ir(IR_IDCODE), 0x1);
+		shift_dr(out, in, 96);
+		CHECK(tap.min_period >= 2 * half);
+	}
+	jtagtap_set_frequency(0);
+	CHECK(jtagtap_get_frequency() > 7000000);
+}
+
+int main()
+{
+	test_init();
+	test_idcode_bypass();
+	test_lengths();
+	test_split_scan();
+	test_cycles_reset();
+	test_frequency();
+	return 0;
+}
@@ -0,0 +1,99 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "check.h"
+#include "gdb_loopback.hpp"
+
+static void test_exchange()
+{
+	GDB_loopback a, b;
+	a.connect(&b);
+
+	char buf[64];
+	CHECK(!b.wait_input(0));
+	CHECK_EQ(b.read_some(buf, sizeof(buf)), 0);
+
+	CHECK(a.write_all("$g#67", 5));
+	CHECK(b.wait_input(-1));
+	CHECK_EQ(b.pending(), 5);
+	/* Short reads leave the rest */
+	CHECK_EQ(b.read_some(buf, 2), 2);
+	CHECK(!memcmp(buf, "$g", 2));
+	CHECK_EQ(b.read_some(buf, sizeof(buf)), 3);
+	CHECK(!memcmp(buf, "#67", 3));
+	CHECK(!b.wait_input(0));
+
+	/* Both directions are independent */
+	CHECK(b.write_all("+", 1));
+	CHECK_EQ(a.read_some(buf, sizeof(buf)), 1);
+	CHECK(buf[0] == '+');
+	CHECK_EQ(b.pending(), 0);
+	CHECK(a.flush());
+}
+
+/* Writes and reads of odd sizes walk the ring across its end many times */
+static void test_wrap()
+{
+	GDB_loopback a, b;
+	a.connect(&b);
+
+	static uint8_t out[3 * GDB_loopback::CAPACITY];
+	static uint8_t in[sizeof(out)];
+	for (size_t i = 0; i < sizeof(out); i++)
+		out[i] = i * 7 + (i >> 8);
+
+	size_t sent = 0, got = 0;
+	const size_t chunks[] = { 1, 1000, 3, 4095, 517, 2048 };
+	for (int round = 0; got < sizeof(out); round++) {
+		size_t n = chunks[round % 6];
+		if (n > sizeof(out) - sent)
+			n = sizeof(out) - sent;
+		if (n && a.write_all(out + sent, n))
+			sent += n;
+		int r = b.read_some(in + got, (round % 3 + 1) * 700);
+		CHECK(r >= 0);
+		got += r;
+		CHECK(round < 10000);
+	}
+	CHECK_EQ(sent, sizeof(out));
+	CHECK(!memcmp(in, out, sizeof(out)));
+}
+
+static void test_full_and_close()
+{
+	GDB_loopback a, b;
+	static uint8_t big[GDB_loopback::CAPACITY];
+	char buf[16];
+
+	/* Unconnected */
+	CHECK(!a.write_all("x", 1));
+	a.connect(&b);
+
+	/* A write that doesn't fit fails whole, nothing is queued */
+	CHECK(a.write_all(big, sizeof(big) - 1));
+	CHECK(!a.write_all("ab", 2));
+	CHECK_EQ(b.pending(), sizeof(big) - 1);
+	CHECK(a.write_all("a", 1));
+	CHECK(!a.write_all("b", 1));
+
+	/* Buffered data is still delivered after a close, then -1 */
+	a.close();
+	CHECK(!a.write_all("c", 1));
+	size_t total = 0;
+	int r;
+	while ((r = b.read_some(big, sizeof(big))) > 0)
+		total += r;
+	CHECK_EQ(total, sizeof(big));
+	CHECK_EQ(r, -1);
+	CHECK(b.wait_input(0));
+	CHECK_EQ(b.read_some(buf, sizeof(buf)), -1);
+	CHECK(!b.write_all("d", 1));
+}
+
+int main()
+{
+	test_exchange();
+	test_wrap();
+	test_full_and_close();
+	return 0;
+}
@@ -0,0 +1,376 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "check.h"
+#include "general.h"
+#include "swd.h"
+
+#define ACK_OK		1U
+#define ACK_WAIT	2U
+#define ACK_FAULT	4U
+
+#define IDCODE		0x2ba01477U
+
+host_gpio_s GPIO;
+bool platform_jtag_active;
+
+/* CCOUNT advances one tick per read, so pacing loops terminate */
+static uint32_t ccount;
+
+uint32_t platform_ccount(void)
+{
+	return ++ccount;
+}
+
+/* Wire level SW-DP. It follows the protocol one SWCLK rising edge at a
+ * time and counts every cycle where the host drives SWDIO while it
+ * should have released it or the other way round.
+ */
+enum swd_phase {
+	IDLE, REQUEST, TRN_ACK, ACK, RDATA, TRN_HOST, TRN_WDATA, WDATA
+};
+
+static struct {
+	swd_phase phase;
+	uint32_t out, enable;
+	/* Level presented while the target drives, the pull-up otherwise */
+	bool target_drives;
+	bool target_level;
+	int n;
+	uint8_t request;
+	uint8_t ack;
+	uint32_t shift;
+	uint32_t dp[4], ap[4];
+	/* Response to the next request, OK afterwards */
+	uint8_t next_ack;
+	bool flip_parity;
+
+	unsigned transfers;
+	unsigned conflicts;
+	unsigned protocol_errors;
+	unsigned parity_errors;
+	unsigned rises;
+	uint32_t last_rise;
+	uint32_t min_period;
+} dp;
+
+static void model_reset()
+{
+	memset(&dp, 0, sizeof(dp));
+	dp.next_ack = ACK_OK;
+	dp.min_period = UINT32_MAX;
+}
+
+static bool host_drives()
+{
+	return dp.enable & (1U << SWDIO_PIN);
+}
+
+static void expect_host(bool drives)
+{
+	if (host_drives() != drives)
+		dp.conflicts++;
+}
+
+static uint32_t reg_read(uint8_t request)
+{
+	const int a = (request >> 3) & 3;
+	if (request & 0x02)
+		return dp.ap[a];
+	return a == 0 ? IDCODE : dp.dp[a];
+}
+
+static void reg_write(uint8_t request, uint32_t value)
+{
+	const int a = (request >> 3) & 3;
+	if (request & 0x02)
+		dp.ap[a] = value;
+	else
+		dp.dp[a] = value;
+}
+
+static bool request_valid(uint8_t request)
+{
+	return (request & 0x81) == 0x81 && !(request & 0x40) &&
+	       __builtin_parity(request & 0x1e) == ((request >> 5) & 1);
+}
+
+static void model_rise()
+{
+	const bool bit = (dp.out >> SWDIO_PIN) & 1U;
+
+	if (dp.rises++ && ccount - dp.last_rise < dp.min_period)
+		dp.min_period = ccount - dp.last_rise;
+	dp.last_rise = ccount;
+
+	switch (dp.phase) {
+	case IDLE:
+		/* Idle cycles are low, a high bit driven by the host starts a
+		 * request */
+		if (host_drives() && bit) {
+			dp.request = 1;
+			dp.n = 1;
+			dp.phase = REQUEST;
+		}
+		break;
+	case REQUEST:
+		expect_host(true);
+		dp.request |= bit << dp.n;
+		if (++dp.n == 8)
+			dp.phase = TRN_ACK;
+		break;
+	case TRN_ACK:
+		expect_host(false);
+		if (!request_valid(dp.request)) {
+			dp.protocol_errors++;
+			dp.phase = IDLE;
+			break;
+		}
+		dp.ack = dp.next_ack;
+		dp.next_ack = ACK_OK;
+		dp.target_drives = true;
+		dp.target_level = dp.ack & 1;
+		dp.n = 0;
+		dp.phase = ACK;
+		break;
+	case ACK:
+		expect_host(false);
+		if (++dp.n < 3) {
+			dp.target_level = (dp.ack >> dp.n) & 1;
+		} else if (dp.ack != ACK_OK) {
+			dp.target_drives = false;
+			dp.phase = TRN_HOST;
+		} else if (dp.request & 0x04) {
+			dp.shift = reg_read(dp.request);
+			dp.target_level = dp.shift & 1;
+			dp.n = 0;
+			dp.phase = RDATA;
+		} else {
+			dp.target_drives = false;
+			dp.phase = TRN_WDATA;
+		}
+		break;
+	case RDATA:
+		expect_host(false);
+		if (++dp.n < 32) {
+			dp.target_level = (dp.shift >> dp.n) & 1;
+		} else if (dp.n == 32) {
+			dp.target_level = __builtin_parity(dp.shift) ^ dp.flip_parity;
+		} else {
+			dp.target_drives = false;
+			dp.transfers++;
+			dp.phase = TRN_HOST;
+		}
+		break;
+	case TRN_HOST:
+		expect_host(false);
+		dp.phase = IDLE;
+		break;
+	case TRN_WDATA:
+		expect_host(false);
+		dp.shift = 0;
+		dp.n = 0;
+		dp.phase = WDATA;
+		break;
+	case WDATA:
+		expect_host(true);
+		if (dp.n < 32) {
+			dp.shift |= (uint32_t)bit << dp.n;
+		} else if (bit != __builtin_parity(dp.shift)) {
+			dp.parity_errors++;
+		} else {
+			reg_write(dp.request, dp.shift);
+			dp.transfers++;
+		}
+		if (++dp.n == 33)
+			dp.phase = IDLE;
+		break;
+	}
+}
+
+void host_gpio_write(host_gpio_reg reg, uint32_t value)
+{
+	const uint32_t out = dp.out;
+	switch (reg) {
+	case HOST_OUT_W1TS:
+		dp.out |= value;
+		break;
+	case HOST_OUT_W1TC:
+		dp.out &= ~value;
+		break;
+	case HOST_ENABLE_W1TS:
+		dp.enable |= value;
+		break;
+	case HOST_ENABLE_W1TC:
+		dp.enable &= ~value;
+		break;
+	}
+	if (!(out & (1U << SWCLK_PIN)) && (dp.out & (1U << SWCLK_PIN)))
+		model_rise();
+}
+
+uint32_t host_gpio_read(void)
+{
+	bool level = true;
+	if (host_drives())
+		level = (dp.out >> SWDIO_PIN) & 1U;
+	else if (dp.target_drives)
+		level = dp.target_level;
+	return (dp.out & ~(1U << SWDIO_PIN)) | ((uint32_t)level << SWDIO_PIN);
+}
+
+/* One DP/AP access the way the ADIv5 layer drives the engine */
+static uint8_t swd_access(bool ap, bool rnw, uint8_t addr, uint32_t *value, bool *parity_error)
+{
+	uint8_t request = 0x81U | (ap ? 0x02U : 0) | (rnw ? 0x04U : 0) | ((addr & 0x0cU) << 1U);
+	if (__builtin_parity(request & 0x1eU))
+		request |= 0x20U;
+	swd_proc.seq_out(request, 8);
+	const uint8_t ack = swd_proc.seq_in(3);
+	if (ack != ACK_OK)
+		return ack;
+	if (rnw)
+		*parity_error = swd_proc.seq_in_parity(value, 32);
+	else
+		swd_proc.seq_out_parity(*value, 32);
+	return ack;
+}
+
+static uint32_t rng = 0x9e3779b9;
+
+static uint32_t next_rand()
+{
+	rng ^= rng << 13;
+	rng ^= rng >> 17;
+	rng ^= rng << 5;
+	return rng;
+}
+
+static void check_clean()
+{
+	CHECK_EQ(dp.conflicts, 0);
+	CHECK_EQ(dp.protocol_errors, 0);
+	CHECK_EQ(dp.parity_errors, 0);
+}
+
+static void test_init()
+{
+	model_reset();
+	platform_jtag_active = true;
+	swdptap_init();
+	CHECK(!platform_jtag_active);
+	CHECK(swd_proc.seq_in && swd_proc.seq_in_parity && swd_proc.seq_out && swd_proc.seq_out_parity);
+	/* The timing read only clocks an idle line */
+	CHECK(dp.phase == IDLE);
+	check_clean();
+}
+
+static void test_transfers()
+{
+	uint32_t value = 0;
+	bool parity_error = true;
+
+	CHECK_EQ(swd_access(false, true, 0x0, &value, &parity_error), ACK_OK);
+	CHECK_EQ(value, IDCODE);
+	CHECK(!parity_error);
+
+	for (int i = 0; i < 500; i++) {
+		const bool ap = next_rand() & 1;
+		/* DP 0x0 reads as IDCODE */
+		const uint8_t addr = ap ? (next_rand() & 0x0c) : 4 + (next_rand() % 3) * 4;
+		uint32_t out = next_rand();
+		CHECK_EQ(swd_access(ap, false, addr, &out, nullptr), ACK_OK);
+		CHECK_EQ(ap ? dp.ap[addr >> 2] : dp.dp[addr >> 2], out);
+		value = ~out;
+		CHECK_EQ(swd_access(ap, true, addr, &value, &parity_error), ACK_OK);
+		CHECK_EQ(value, out);
+		CHECK(!parity_error);
+		/* Idle cycles of odd lengths take the generic loop */
+		if (i % 7 == 0)
+			swd_proc.seq_out(0, 1 + i % 13);
+	}
+	CHECK_EQ(dp.transfers, 1001);
+	check_clean();
+}
+
+/* WAIT and FAULT have no data phase, the next request must still line up */
+static void test_wait_fault()
+{
+	uint32_t value = 0x1234;
+	bool parity_error;
+
+	dp.next_ack = ACK_WAIT;
+	CHECK_EQ(swd_access(true, false, 0x4, &value, nullptr), ACK_WAIT);
+	CHECK_EQ(swd_access(true, false, 0x4, &value, nullptr), ACK_OK);
+	CHECK_EQ(dp.ap[1], 0x1234);
+
+	dp.next_ack = ACK_FAULT;
+	CHECK_EQ(swd_access(true, true, 0x4, &value, &parity_error), ACK_FAULT);
+	value = 0;
+	CHECK_EQ(swd_access(true, true, 0x4, &value, &parity_error), ACK_OK);
+	CHECK_EQ(value, 0x1234);
+	CHECK(!parity_error);
+	check_clean();
+}
+
+static void test_parity()
+{
+	uint32_t value;
+	bool parity_error = false;
+
+	dp.ap[2] = 0xa5a5f00f;
+	dp.flip_parity = true;
+	CHECK_EQ(swd_access(true, true, 0x8, &value, &parity_error), ACK_OK);
+	CHECK(parity_error);
+	CHECK_EQ(value, 0xa5a5f00f);
+	dp.flip_parity = false;
+	CHECK_EQ(swd_access(true, true, 0x8, &value, &parity_error), ACK_OK);
+	CHECK(!parity_error);
+
+	/* Short reads from a released line see the pull-up */
+	CHECK_EQ(swd_proc.seq_in(5), 0x1f);
+	CHECK(!swd_proc.seq_in_parity(&value, 7));
+	CHECK_EQ(value, 0x7f);
+	check_clean();
+}
+
+/* Rising edges are at least a full period apart at any requested clock */
+static void test_frequency()
+{
+	swdptap_set_frequency(1000000);
+	CHECK_EQ(swdptap_get_frequency(), 1000000);
+
+	const uint32_t freqs[] = { 100000, 1000000, 3000000, 7000000 };
+	for (uint32_t freq : freqs) {
+		swdptap_set_frequency(freq);
+		const uint32_t half = PLATFORM_CPU_HZ / freq / 2;
+		CHECK(swdptap_get_frequency() >= freq);
+		CHECK(swdptap_get_frequency() <= PLATFORM_CPU_HZ / (2 * half));
+
+		dp.rises = 0;
+		dp.min_period = UINT32_MAX;
+		uint32_t value = next_rand();
+		bool parity_error;
+		CHECK_EQ(swd_access(false, false, 0x8, &value, nullptr), ACK_OK);
+		CHECK_EQ(swd_access(false, true, 0x8, &value, &parity_error), ACK_OK);
+		CHECK(dp.min_period >= 2 * half);
+	}
+
+	/* Beyond what the code can clock the full speed rate is reported */
+	swdptap_set_frequency(PLATFORM_CPU_HZ);
+	const uint32_t max = swdptap_get_frequency();
+	CHECK(max > 7000000);
+	swdptap_set_frequency(0);
+	CHECK_EQ(swdptap_get_frequency(), max);
+	check_clean();
+}
+
+int main()
+{
+	test_init();
+	test_transfers();
+	test_wait_fault();
+	test_parity();
+	test_frequency();
+	return 0;
+}